@@ -1,4 +1,4 @@
-/* These must be provided by the application. */
+/* These must be provided by the application (see src/app/linux.c for a reference implementation). */
 #ifndef __MEAGER_DB_APP_H__
 #define __MEAGER_DB_APP_H__
 
@@ -24,6 +24,46 @@ int mdba_lseek (int fd, uint64_t offset, int whence);
 int mdba_fsync (int fd);
 
 
+/*
+ * Optional positional and vectored I/O.  These are declared weak; if the application doesn't
+ * define them, mdba_lseek followed by mdba_read/mdba_write is used instead.  Providing them
+ * turns every page read or write into a single call.
+ */
+typedef struct
+{
+	void const *base;
+	size_t len;
+} MDBA_IOVEC;
+
+/* Must read count bytes at offset, otherwise consider it a failure.  Return -1 on failure, 0 on success. */
+int mdba_pread (int fd, void *buf, size_t count, uint64_t offset) __attribute__ ((weak));
+
+/* Must write all the buffers, one after the other, at offset.  Return -1 on failure, 0 on success. */
+int mdba_pwritev (int fd, MDBA_IOVEC const *iov, int iovcnt, uint64_t offset) __attribute__ ((weak));
+
+/*
+ * Optional memory mapped reads, also declared weak.  Return a pointer to count bytes of the file
+ * at offset, or NULL if they can't be mapped (they are then read normally).  Must reflect
+ * everything written so far, even past the end of an earlier mapping.  The pointer only has to
+ * stay valid until the next call into the application layer.
+ */
+void const *mdba_map (int fd, uint64_t offset, size_t count) __attribute__ ((weak));
+
+/*
+ * Optional read-ahead hint, also declared weak.  The database will soon call mdba_pread with
+ * exactly these arguments, so the application may start reading them asynchronously.  It may
+ * also ignore the hint.  Anything written afterwards must not be served from a stale read.
+ */
+void mdba_prefetch (int fd, uint64_t offset, size_t count) __attribute__ ((weak));
+
+/*
+ * Optional threads, also declared weak.  Call `fn (arg, i)` for every `i` below `count`, on as
+ * many threads as possible, and return once all of them have returned.  mdb_parallel_walk then
+ * calls mdba_pread on several threads at once, so it must be thread-safe.
+ */
+void mdba_parallel (void (*fn) (void *arg, uint32_t i), void *arg, uint32_t count) __attribute__ ((weak));
+
+
 /* Misc */
 void mdba_read_urandom (void *dst, size_t len);
 
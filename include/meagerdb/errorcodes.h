@@ -25,6 +25,9 @@ enum {
 	MDBE_BAD_TYPE = -20,               /* Key-Value: Value is not of the requested type */
 	MDBE_NOT_FOUND = -21,              /* */
 	MDBE_UNSUPPORTED_CIPHER = -22,     /* Ciphersuite is not supported */
+	MDBE_NO_TRANSACTION = -24,         /* Must begin a transaction before calling this function */
+	MDBE_NO_PAGE_BUFFER = -25,         /* Page size needs a buffer in MDB_OPTIONS.page_buffer */
+	MDBE_READ_ONLY = -26,              /* The database was opened with MDB_OPTIONS.read_only */
 };
 
 #endif
@@ -17,7 +17,13 @@ typedef struct
 
 
 /* 
- * Update the currently selected row using a list of key-value updates.
+ * Update the currently selected row using a list of key-value updates.  A NULL `value` stores
+ * `valuelen` zeros.
+ *
+ * The row is rewritten with a key directory (see database-specification.md), so that
+ * mdbk_get_value can find a key by binary search.  Rows in the older format, a list of chunks,
+ * are still read, and are converted the first time they are updated.  Version 1.0 databases,
+ * which older libraries can open, keep the older format.
  */
 int mdbk_update (MDB *db, MDBK_UPDATE_ENTRY const *updates, size_t update_count);
 
@@ -36,7 +42,9 @@ int64_t mdbk_get_value (MDB *db, void *dst, uint8_t const key[static MDBK_KEY_LE
 
 
 /*
- * Reads the 'idx'th key from the currently selected row.
+ * Reads the 'idx'th key from the currently selected row.  Keys are in sorted order (memcmp), except
+ * in rows of the older format that haven't been updated since, where they are in the order they
+ * were stored.
  */
 int mdbk_read_key (MDB *db, uint8_t dst[static MDBK_KEY_LEN], uint32_t idx);
 
@@ -10,29 +10,120 @@
 /* 
  * We require limits on some database properties, to fit the implementation into a reasonable amount
  * of RAM.
- * MDB_MAX_PAGE_SIZE will affect the size of the MDB struct.
+ * MDB_MAX_PAGE_SIZE will affect the size of the MDB struct.  Pages larger than that, up to
+ * MDB_MAX_LARGE_PAGE_SIZE, are handled in a buffer provided by the caller (MDB_OPTIONS.page_buffer).
  */
 
 #define MDB_DEFAULT_PAGE_SIZE 256
 #define MDB_MAX_PAGE_SIZE 512
+#define MDB_MAX_LARGE_PAGE_SIZE 65536
 
+/* Number of free extents tracked by the free space map.  Affects the size of the MDB struct. */
+#define MDB_FSM_EXTENTS 16
+
+/* Number of rows mdb_walk looks up in the primary index at once.  Affects the size of the MDB struct. */
+#define MDB_WALK_ROWS 16
+
+/* Number of threads mdb_parallel_walk can use.  Affects the size of the stack during the walk. */
+#define MDB_MAX_WALK_THREADS 64
+
+/* Number of rows a transaction deletes or updates (adjacent rows count once) that are kept in the
+ * MDB struct.  More are written out to the database as the transaction goes, which makes them
+ * slower to check.  Affects the size of the MDB struct. */
+#define MDB_TXN_DELETES 32
+
+/* Number of pages read, authenticated and written together (see MDB_OPTIONS.batch_buffer).
+ * Affects the size of the MDB struct, and of the stack during reads. */
+#define MDB_BATCH_PAGES 8
+
+
+/* Size of the buffer needed for pages of `page_size`.
+ * Extra 8 bytes so we can append MAC tweak to pages during authentication */
+#define MDB_PAGE_BUFFER_SIZE(page_size) ((size_t)(page_size) + 8)
+#define MDB_TMP_SIZE MDB_PAGE_BUFFER_SIZE (MDB_MAX_PAGE_SIZE)
+
+/* Size of a buffer for MDB_BATCH_PAGES pages of `page_size` */
+#define MDB_BATCH_BUFFER_SIZE(page_size) ((size_t)MDB_BATCH_PAGES * MDB_PAGE_BUFFER_SIZE (page_size))
+
+typedef struct
+{
+	uint32_t start;
+	uint32_t count;
+} MDB_EXTENT;
+
+
+/* Ciphersuites, named in the database header.  MDB_OPTIONS.ciphersuite picks one for mdb_create_ex. */
+#define MDB_CIPHERSUITE_THREEFISH "Threefish-512:SHA-256:HMAC"   /* The default */
+#define MDB_CIPHERSUITE_AES "AES-256-XTS:SHA-256:HMAC"            /* Uses AES-NI when available */
+#define MDB_CIPHERSUITE_PLAINTEXT "Plaintext:SHA-256:CRC32C"     /* Not encrypted, and only guards against accidental damage */
+
+
+/* File format versions (MDB.version) */
+#define MDB_VERSION_1_0 0x0100
+#define MDB_VERSION_1_1 0x0101
+
+
+/* Keys as expanded by the ciphersuite (mdbc_expand_keys), once per open instead of once per page */
+typedef struct
+{
+	uint8_t suite;             /* Which ciphersuite they are for */
+
+	union
+	{
+		uint64_t threefish[9];             /* Threefish-512 key words and their parity word */
+
+		struct
+		{
+			uint8_t encrypt[240];          /* AES-256 round keys for data */
+			uint8_t decrypt[240];          /* ... for the inverse cipher */
+			uint8_t tweak[240];            /* ... for tweaks */
+		} aes;
+	} cipher;
+
+	uint32_t hmac_inner[8];    /* HMAC-SHA-256 state after the inner pad block */
+	uint32_t hmac_outer[8];    /* HMAC-SHA-256 state after the outer pad block */
+	uint32_t crc_key;          /* CRC-32C of the MAC key, which page checksums start from (MDB_CIPHERSUITE_PLAINTEXT) */
+} MDB_CIPHER_KEYS;
 
-/* Extra 8 bytes so we can append MAC tweak to pages during authentication */
-#define MDB_TMP_SIZE (MDB_MAX_PAGE_SIZE+8)
 
 /* Information about the currently open database */
 typedef struct
 {
 	int fd;
+	uint16_t version;
 	uint32_t page_size;
 	uint32_t real_page_size;   /* How much can actually be stored in page */
 	uint8_t keys[128];
+	MDB_CIPHER_KEYS cipher_keys;   /* keys, expanded */
 	uint64_t page_offset;      /* File position where Pages start */
+	uint32_t first_page;       /* Page where rows start */
+
+	/* Free space map: the terminator row and extents of empty rows, sorted by page */
+	uint32_t fsm_end;
+	uint32_t fsm_count;
+	MDB_EXTENT fsm[MDB_FSM_EXTENTS];
+	bool fsm_valid;
+	bool fsm_lossy;            /* Some free extents didn't fit, and were forgotten */
+
+	/* Primary index, a B+tree of (table, rowid) -> page */
+	uint8_t index_state;
+	uint32_t index_root;
+	uint32_t index_height;     /* 0 when the index is empty */
+	uint32_t index_next;       /* Next unused node page, in the current index extent */
+	uint32_t index_end;        /* End of the current index extent */
 
 	/* Selected Page */
 	uint32_t selected_page;
 	uint32_t selected_page_count;
 
+	/* Walk through the primary index: the rowid selected last, and the next rows */
+	uint8_t walk_table;
+	uint32_t walk_rowid;
+	uint32_t walk_count;
+	uint32_t walk_next;
+	uint32_t walk_rowids[MDB_WALK_ROWS];
+	uint32_t walk_pages[MDB_WALK_ROWS];
+
 	/* Row being inserted */
 	uint32_t insert_page;
 	uint32_t insert_page_count;
@@ -42,19 +133,151 @@ typedef struct
 	uint32_t update_page;
 	uint32_t update_page_count;
 
+	/* Open transaction */
+	uint32_t txn_page;         /* End of the database when it began; 0 if there is none */
+	uint32_t txn_count;
+	MDB_EXTENT txn_deletes[MDB_TXN_DELETES];   /* Rows to delete when it commits */
+	MDB_EXTENT txn_spilled;    /* The last commit row that earlier txn_deletes were written to */
+	uint32_t txn_spills;       /* Number of such commit rows */
+
 	uint32_t tmp_page;
-	uint8_t tmp[MDB_TMP_SIZE];
+	uint8_t *tmp;              /* tmp_buffer, or the caller's buffer for large pages */
+	size_t tmp_size;
+	uint8_t tmp_buffer[MDB_TMP_SIZE];
+
+	/* Read-ahead during scans of the rows */
+	uint32_t scan_page;        /* Row header read last */
+	uint32_t scan_ahead;       /* Pages before this have already been hinted */
+	uint32_t scan_window;
+
+	uint8_t sync_mode;
+	bool unsynced;             /* Pages were written since the last fsync */
+	bool read_only;            /* MDB_OPTIONS.read_only */
+
+	/* Decrypted page cache (optional, see MDB_OPTIONS) */
+	uint8_t *cache;
+	uint32_t cache_count;
+	uint32_t cache_hand;
+	uint32_t cache_buckets;    /* Open addressing on the page number, two buckets per entry */
+
+	/* Pages read together (optional, see MDB_OPTIONS), one per MDB_PAGE_BUFFER_SIZE of batch */
+	uint8_t *batch;
+	uint32_t batch_slots;      /* How many pages fit, up to MDB_BATCH_PAGES */
+	uint32_t batch_count;
+	uint32_t batch_pages[MDB_BATCH_PAGES];   /* 0 for pages that failed authentication */
 } MDB;
 
 
+/* Size of a cache arena that holds `count` pages of a database with the given `page_size`. */
+#define MDB_CACHE_ARENA_SIZE(count, page_size) ((size_t)(count) * (16 + (size_t)(page_size)))
+
+
+/* Durability modes (MDB_OPTIONS.sync_mode) */
+enum {
+	/* fsync after every page write. */
+	MDB_SYNC_FULL = 0,
+
+	/*
+	 * Only fsync around journal writes: once before a journal is set or cleared, and once after.
+	 * Pages written while a journal is open are not synced individually.  Every operation is
+	 * still atomic and durable when it returns, but costs a constant number of fsyncs instead
+	 * of one (or more) per page.
+	 */
+	MDB_SYNC_JOURNAL = 1,
+};
+
+
+/* Optional settings for mdb_open_ex.  Zero all fields for the defaults. */
+typedef struct
+{
+	/*
+	 * Arena for a cache of authenticated and decrypted pages.  The cache holds as many
+	 * pages as fit into `cache_size` bytes (see MDB_CACHE_ARENA_SIZE), and is evicted
+	 * using the CLOCK algorithm.  Writes update the cache.
+	 * The arena belongs to the database until mdb_close, which wipes it.
+	 * NULL disables the cache.
+	 */
+	void *cache;
+	size_t cache_size;
+
+	/* One of the MDB_SYNC_* modes. */
+	uint8_t sync_mode;
+
+	/*
+	 * Buffer for pages larger than MDB_MAX_PAGE_SIZE, at least MDB_PAGE_BUFFER_SIZE (page_size)
+	 * bytes.  Not used for smaller pages, which fit into the MDB struct.
+	 * The buffer belongs to the database until mdb_close, which wipes it.
+	 */
+	void *page_buffer;
+	size_t page_buffer_size;
+
+	/* One of the MDB_CIPHERSUITE_* names, or NULL for the default.  Only used by mdb_create_ex;
+	 * mdb_open uses the one the database was created with. */
+	char const *ciphersuite;
+
+	/*
+	 * Buffer for reading or writing several pages at once: the rest of a long value, the rows
+	 * ahead of a scan or a walk, and the empty rows written by journal recovery.  Their MACs are
+	 * then computed together, which is several times faster on CPUs with wide vector units.  Holds
+	 * as many pages as fit into `batch_buffer_size` bytes, up to MDB_BATCH_PAGES (see
+	 * MDB_BATCH_BUFFER_SIZE).
+	 * The buffer belongs to the database until mdb_close, which wipes it.
+	 * NULL handles one page at a time.
+	 */
+	void *batch_buffer;
+	size_t batch_buffer_size;
+
+	/*
+	 * Receives the keys that open the database, MDB_WRAPPED_KEY_SIZE bytes, when it is opened,
+	 * encrypted and MACed under `wrapping_key`.  Passing them back as `wrapped_key` opens the
+	 * database again without the password, and without the slow key derivation.  They open
+	 * nothing but this database, and only together with the wrapping key, which the application
+	 * keeps elsewhere (e.g. in a hardware key store).  Only used by mdb_open_ex.
+	 */
+	uint8_t *wrapped_key_out;
+
+	/*
+	 * Open the file read-only, and change nothing: an interrupted operation isn't recovered (its
+	 * journal is left open, for mdb_verify to report), and an index or free space map that
+	 * isn't up to date isn't rebuilt, but ignored.  Inserts, updates, deletes and transactions
+	 * fail with MDBE_READ_ONLY.  Only used by mdb_open_ex.
+	 */
+	bool read_only;
+
+	/* Keys from `wrapped_key_out` to open with instead of the password, which is then ignored
+	 * (and may be NULL).  A wrong or damaged key, or the wrong wrapping key, fails with
+	 * MDBE_BAD_PASSWORD. */
+	uint8_t const *wrapped_key;
+
+	/* MDB_WRAPPING_KEY_SIZE random bytes, needed with `wrapped_key_out` or `wrapped_key` */
+	uint8_t const *wrapping_key;
+} MDB_OPTIONS;
+
+/* Sizes of MDB_OPTIONS.wrapped_key and MDB_OPTIONS.wrapping_key */
+#define MDB_WRAPPED_KEY_SIZE 160
+#define MDB_WRAPPING_KEY_SIZE 128
+
+
 
 /* Create a MeagerDB at the given 'path', using the given 'password'. */
 int mdb_create (MDB *db, char const *path, uint8_t const *password, size_t password_len, uint64_t iteration_count);
 
 
+/*
+ * Same as mdb_create, but with the given `page_size`: a power of two from 256 to
+ * MDB_MAX_LARGE_PAGE_SIZE.  Only `page_buffer` and `ciphersuite` are used from `options`, which may
+ * be NULL.
+ */
+int mdb_create_ex (MDB *db, char const *path, uint8_t const *password, size_t password_len, uint64_t iteration_count, uint32_t page_size, MDB_OPTIONS const *options);
+
+
 int mdb_open (MDB *db, char const *path, uint8_t const *password, size_t password_len);
 
 
+/* Same as mdb_open, but with additional settings.  `options` may be NULL. */
+int mdb_open_ex (MDB *db, char const *path, uint8_t const *password, size_t password_len, MDB_OPTIONS const *options);
+
+
 void mdb_close (MDB *db);
 
 
@@ -63,11 +286,70 @@ void mdb_close (MDB *db);
  * With `restart` == true, the first row is selected.
  * With `restart` == false, the next row is selected.
  * Return value is less than 0 for error, 0 for success, and 1 if there are no more rows.
+ *
+ * Rows are visited in rowid order, using the primary index, so only the table's own rows are
+ * read.  In version 1.0 databases, every row in the database is read, in page order.
  */
 int mdb_walk (MDB *db, uint8_t table, bool restart);
 
 
-/* Make the row specified by `table` and `rowid` the currently selected row. */
+/*
+ * Called by mdb_parallel_walk with each row's rowid and value.  `thread` is the number of the
+ * calling thread, below the number of threads requested.  Returning anything but 0 stops the walk,
+ * and mdb_parallel_walk returns it.
+ */
+typedef int (*MDB_WALK_CALLBACK) (void *ctx, uint32_t thread, uint32_t rowid, void const *value, uint32_t len);
+
+
+/* Size of the buffer mdb_parallel_walk needs per thread, for values of up to `max_value_len` bytes. */
+#define MDB_WALK_BUFFER_SIZE(page_size, max_value_len) (2 * MDB_PAGE_BUFFER_SIZE (page_size) + MDB_BATCH_BUFFER_SIZE (page_size) + (size_t)(max_value_len))
+
+
+/*
+ * Call `callback` for every row in `table`, on `threads` threads at once (see mdba_parallel in
+ * app.h).  The table's rowids are split evenly between the threads, and each reads, authenticates
+ * and decrypts its own rows.  `buffers` holds one buffer of `buffer_size` bytes per thread; a value
+ * that doesn't fit fails with MDBE_DATA_TOO_BIG.
+ *
+ * Rows are handed to the callback in rowid order on each thread, but in no particular order
+ * overall.  Neither the callback nor anything else may use the database until this returns.
+ * The walk runs on the calling thread if the application layer has no mdba_parallel or mdba_pread,
+ * and without the primary index.
+ */
+int mdb_parallel_walk (MDB *db, uint8_t table, MDB_WALK_CALLBACK callback, void *ctx, uint32_t threads, void *buffers, size_t buffer_size);
+
+
+/* Problems reported by mdb_verify */
+enum {
+	MDB_VERIFY_CORRUPT_PAGES = 1,    /* Pages that fail authentication */
+	MDB_VERIFY_BAD_ROW,              /* A row header that makes no sense */
+	MDB_VERIFY_UNINDEXED_ROW,        /* A row the primary index doesn't point to */
+	MDB_VERIFY_ORPHANED_SPAN,        /* Empty rows the free space map lost, or a leftover commit row */
+	MDB_VERIFY_FREE_SPACE_MAP,       /* Free space map extent that isn't empty rows, or a wrong terminator */
+	MDB_VERIFY_OPEN_JOURNAL,         /* A journal that should have been cleared (the span it covers, none to roll back a transaction) */
+};
+
+
+/* Called by mdb_verify for each problem, with the span of pages it concerns.  May be called on
+ * several threads at once. */
+typedef void (*MDB_VERIFY_CALLBACK) (void *ctx, int problem, uint32_t page, uint32_t page_count);
+
+
+/*
+ * Check the integrity of the whole database: the journals, the metadata pages, every row header
+ * against the free space map and the primary index, and the MAC of every page up to the
+ * terminator.  Pages are authenticated on `threads` threads at once (see mdb_parallel_walk), each
+ * using its own MDB_BATCH_BUFFER_SIZE (page_size) bytes of `buffers`.
+ * Returns the number of problems reported to `callback`, or an error.
+ * Rows after a row header that fails authentication, or makes no sense, can't be checked.
+ */
+int mdb_verify (MDB *db, MDB_VERIFY_CALLBACK callback, void *ctx, uint32_t threads, void *buffers);
+
+
+/*
+ * Make the row specified by `table` and `rowid` the currently selected row.
+ * This is O(log N) using the primary index, or O(N) in version 1.0 databases.
+ */
 int mdb_select_by_rowid (MDB *db, uint8_t table, uint32_t rowid);
 
 
@@ -76,7 +358,7 @@ int mdb_select_by_rowid (MDB *db, uint8_t table, uint32_t rowid);
  * doesn't have as many safety checks.  It should be used with caution.  All guarantees
  * are broken if this function is used to select a Page that isn't the beginning of a row.
  *
- * This is O(1), whereas selecting by rowid is O(N); N == number of rows in DB.
+ * This is O(1), whereas selecting by rowid is O(log N); N == number of rows in DB.
  */
 int mdb_select_by_page (MDB *db, uint32_t page);
 
@@ -100,7 +382,11 @@ int mdb_read_value (MDB *db, void *dst, uint32_t offset, size_t len);
 int mdb_get_rowid (MDB *db, uint32_t *page, uint8_t *table, uint32_t *rowid);
 
 
-/* Return the next available (unused) rowid, or 0 on error. */
+/*
+ * Return the next available (unused) rowid, or 0 on error.
+ * This is O(1).  Rowids are not reused, even if the row with the highest rowid is deleted
+ * (except in version 1.0 databases, where this walks the table).
+ */
 int mdb_get_next_rowid (MDB *db, uint8_t table, uint32_t *rowid);
 
 
@@ -140,4 +426,26 @@ int mdb_update_finalize (MDB *db);
 int mdb_delete (MDB *db);
 
 
+/*
+ * Group any number of inserts, updates and deletes into one transaction, which commits
+ * atomically when mdb_txn_commit returns.  The operations themselves don't touch the journals,
+ * so a transaction costs a constant number of syncs in MDB_SYNC_JOURNAL mode.
+ *
+ * Rows written in a transaction are always appended to the end of the database, and the rows it
+ * deletes or replaces are only freed when it commits.  Changes are visible to the transaction's
+ * own reads right away.
+ *
+ * A transaction that isn't committed before mdb_close is rolled back the next time the database
+ * is opened.  Not supported for version 1.0 databases.
+ */
+int mdb_txn_begin (MDB *db);
+
+
+int mdb_txn_commit (MDB *db);
+
+
+/* Roll back the open transaction.  This rebuilds the primary index, so it's O(N log N). */
+int mdb_txn_abort (MDB *db);
+
+
 #endif
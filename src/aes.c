@@ -0,0 +1,338 @@
+/*
+ * AES-256 and the XTS mode, with an AES-NI backend chosen at runtime.
+ * The portable backend looks up the S-box in a table, so unlike AES-NI its timing may depend on
+ * the data on CPUs with caches.
+ */
+#include "aes.h"
+#include <string.h>
+#include <stdbool.h>
+#include <meagerdb/app.h>
+#include "basic_packing.h"
+#include "util.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	#define AES_X86 1
+	#include <immintrin.h>
+#else
+	#define AES_X86 0
+#endif
+
+
+static uint8_t const SBOX[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static uint8_t const INV_SBOX[256] = {
+	0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb,
+	0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb,
+	0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e,
+	0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25,
+	0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92,
+	0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84,
+	0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06,
+	0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b,
+	0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73,
+	0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e,
+	0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b,
+	0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4,
+	0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f,
+	0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef,
+	0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
+	0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d,
+};
+
+
+/* Multiply by x in GF(2^8) */
+static inline uint8_t xtime (uint8_t a)
+{
+	return (uint8_t)((a << 1) ^ ((a >> 7) * 0x1b));
+}
+
+
+/* Multiply in GF(2^8) */
+static uint8_t gf_mul (uint8_t a, uint8_t b)
+{
+	uint8_t result = 0;
+
+	for (; b; b >>= 1, a = xtime (a))
+		result ^= (uint8_t)(a & -(b & 1));
+
+	return result;
+}
+
+
+void mdbc_aes256_expand_key (uint8_t round_keys[static 240], uint8_t const key[static 32])
+{
+	uint8_t rcon = 1;
+
+	memcpy (round_keys, key, 32);
+
+	for (unsigned int i = 8; i < 60; ++i)
+	{
+		uint8_t temp[4];
+
+		memcpy (temp, round_keys + 4 * (i - 1), 4);
+
+		if (i % 8 == 0)
+		{
+			uint8_t first = temp[0];
+
+			temp[0] = SBOX[temp[1]] ^ rcon;
+			temp[1] = SBOX[temp[2]];
+			temp[2] = SBOX[temp[3]];
+			temp[3] = SBOX[first];
+			rcon = xtime (rcon);
+		}
+		else if (i % 8 == 4)
+		{
+			for (unsigned int j = 0; j < 4; ++j)
+				temp[j] = SBOX[temp[j]];
+		}
+
+		for (unsigned int j = 0; j < 4; ++j)
+			round_keys[4 * i + j] = round_keys[4 * (i - 8) + j] ^ temp[j];
+	}
+}
+
+
+/* InvMixColumns on one column */
+static void inv_mix_column (uint8_t col[static 4])
+{
+	uint8_t a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+
+	col[0] = gf_mul (a0, 14) ^ gf_mul (a1, 11) ^ gf_mul (a2, 13) ^ gf_mul (a3, 9);
+	col[1] = gf_mul (a0, 9) ^ gf_mul (a1, 14) ^ gf_mul (a2, 11) ^ gf_mul (a3, 13);
+	col[2] = gf_mul (a0, 13) ^ gf_mul (a1, 9) ^ gf_mul (a2, 14) ^ gf_mul (a3, 11);
+	col[3] = gf_mul (a0, 11) ^ gf_mul (a1, 13) ^ gf_mul (a2, 9) ^ gf_mul (a3, 14);
+}
+
+
+void mdbc_aes256_inverse_keys (uint8_t decrypt_keys[static 240], uint8_t const encrypt_keys[static 240])
+{
+	for (unsigned int round = 0; round < 15; ++round)
+	{
+		memcpy (decrypt_keys + 16 * round, encrypt_keys + 16 * (14 - round), 16);
+
+		if (round != 0 && round != 14)
+		{
+			for (unsigned int c = 0; c < 4; ++c)
+				inv_mix_column (decrypt_keys + 16 * round + 4 * c);
+		}
+	}
+}
+
+
+static void encrypt_block (uint8_t block[static 16], uint8_t const round_keys[static 240])
+{
+	uint8_t s[16];
+
+	for (unsigned int i = 0; i < 16; ++i)
+		block[i] ^= round_keys[i];
+
+	for (unsigned int round = 1; round <= 14; ++round)
+	{
+		/* SubBytes and ShiftRows */
+		for (unsigned int c = 0; c < 4; ++c)
+			for (unsigned int r = 0; r < 4; ++r)
+				s[r + 4 * c] = SBOX[block[r + 4 * ((c + r) & 3)]];
+
+		/* MixColumns, except in the last round */
+		for (unsigned int c = 0; c < 4 && round < 14; ++c)
+		{
+			uint8_t *col = s + 4 * c;
+			uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+			uint8_t first = col[0];
+
+			col[0] ^= all ^ xtime (col[0] ^ col[1]);
+			col[1] ^= all ^ xtime (col[1] ^ col[2]);
+			col[2] ^= all ^ xtime (col[2] ^ col[3]);
+			col[3] ^= all ^ xtime (col[3] ^ first);
+		}
+
+		for (unsigned int i = 0; i < 16; ++i)
+			block[i] = s[i] ^ round_keys[16 * round + i];
+	}
+
+	secure_memset (s, 0, sizeof (s));
+}
+
+
+/* The equivalent inverse cipher, with the keys from mdbc_aes256_inverse_keys */
+static void decrypt_block (uint8_t block[static 16], uint8_t const decrypt_keys[static 240])
+{
+	uint8_t s[16];
+
+	for (unsigned int i = 0; i < 16; ++i)
+		block[i] ^= decrypt_keys[i];
+
+	for (unsigned int round = 1; round <= 14; ++round)
+	{
+		/* InvSubBytes and InvShiftRows */
+		for (unsigned int c = 0; c < 4; ++c)
+			for (unsigned int r = 0; r < 4; ++r)
+				s[r + 4 * ((c + r) & 3)] = INV_SBOX[block[r + 4 * c]];
+
+		/* InvMixColumns, except in the last round */
+		for (unsigned int c = 0; c < 4 && round < 14; ++c)
+			inv_mix_column (s + 4 * c);
+
+		for (unsigned int i = 0; i < 16; ++i)
+			block[i] = s[i] ^ decrypt_keys[16 * round + i];
+	}
+
+	secure_memset (s, 0, sizeof (s));
+}
+
+
+/* Multiply the XTS tweak by x in GF(2^128) */
+static void xts_next (uint8_t tweak[static 16])
+{
+	uint8_t carry = tweak[15] >> 7;
+
+	for (unsigned int i = 15; i > 0; --i)
+		tweak[i] = (uint8_t)((tweak[i] << 1) | (tweak[i - 1] >> 7));
+
+	tweak[0] = (uint8_t)((tweak[0] << 1) ^ (carry * 0x87));
+}
+
+
+static void xts_c (uint8_t *dst, uint8_t const data_keys[static 240], uint8_t const tweak_keys[static 240], uint8_t const *src, size_t blocks, uint64_t location, bool encrypt)
+{
+	uint8_t tweak[16] = {0}, block[16];
+
+	pack_uint64_little (tweak, location);
+	encrypt_block (tweak, tweak_keys);
+
+	for (; blocks; --blocks, src += 16, dst += 16)
+	{
+		for (unsigned int i = 0; i < 16; ++i)
+			block[i] = src[i] ^ tweak[i];
+
+		if (encrypt)
+			encrypt_block (block, data_keys);
+		else
+			decrypt_block (block, data_keys);
+
+		for (unsigned int i = 0; i < 16; ++i)
+			dst[i] = block[i] ^ tweak[i];
+
+		xts_next (tweak);
+	}
+
+	secure_memset (tweak, 0, sizeof (tweak));
+	secure_memset (block, 0, sizeof (block));
+}
+
+
+#if AES_X86
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+static AESNI_TARGET inline __m128i xts_next_aesni (__m128i tweak)
+{
+	/* Shift each 32-bit word left, carrying each top bit into the next word (and the top bit
+	 * of the block back into the bottom byte, as 0x87) */
+	__m128i carry = _mm_srai_epi32 (_mm_shuffle_epi32 (tweak, 0x93), 31);
+
+	carry = _mm_and_si128 (carry, _mm_set_epi32 (1, 1, 1, 0x87));
+
+	return _mm_xor_si128 (_mm_slli_epi32 (tweak, 1), carry);
+}
+
+
+/* Four blocks at a time keep the AES units busy; the rest one at a time */
+static AESNI_TARGET inline __attribute__((always_inline)) void xts_aesni (uint8_t *dst, uint8_t const data_keys[static 240], uint8_t const tweak_keys[static 240], uint8_t const *src, size_t blocks, uint64_t location, bool encrypt)
+{
+	__m128i k[15], t[4], x[4];
+	__m128i tweak = _mm_set_epi64x (0, (long long)location);
+
+	tweak = _mm_xor_si128 (tweak, _mm_loadu_si128 ((__m128i const *)tweak_keys));
+
+	for (unsigned int round = 1; round < 14; ++round)
+		tweak = _mm_aesenc_si128 (tweak, _mm_loadu_si128 ((__m128i const *)(tweak_keys + 16 * round)));
+
+	tweak = _mm_aesenclast_si128 (tweak, _mm_loadu_si128 ((__m128i const *)(tweak_keys + 16 * 14)));
+
+	for (unsigned int round = 0; round < 15; ++round)
+		k[round] = _mm_loadu_si128 ((__m128i const *)(data_keys + 16 * round));
+
+	while (blocks)
+	{
+		unsigned int n = (blocks >= 4) ? 4 : 1;
+
+		for (unsigned int i = 0; i < n; ++i)
+		{
+			t[i] = tweak;
+			tweak = xts_next_aesni (tweak);
+			x[i] = _mm_xor_si128 (_mm_loadu_si128 ((__m128i const *)(src + 16 * i)), _mm_xor_si128 (t[i], k[0]));
+		}
+
+		for (unsigned int round = 1; round < 14; ++round)
+		{
+			for (unsigned int i = 0; i < n; ++i)
+				x[i] = encrypt ? _mm_aesenc_si128 (x[i], k[round]) : _mm_aesdec_si128 (x[i], k[round]);
+		}
+
+		for (unsigned int i = 0; i < n; ++i)
+		{
+			x[i] = encrypt ? _mm_aesenclast_si128 (x[i], k[14]) : _mm_aesdeclast_si128 (x[i], k[14]);
+			_mm_storeu_si128 ((__m128i *)(dst + 16 * i), _mm_xor_si128 (x[i], t[i]));
+		}
+
+		src += 16 * n;
+		dst += 16 * n;
+		blocks -= n;
+	}
+
+	secure_memset (k, 0, sizeof (k));
+}
+
+
+/* Separate copies for each direction, so the rounds aren't branching on it */
+static AESNI_TARGET void xts_encrypt_aesni (uint8_t *dst, uint8_t const data_keys[static 240], uint8_t const tweak_keys[static 240], uint8_t const *src, size_t blocks, uint64_t location)
+{
+	xts_aesni (dst, data_keys, tweak_keys, src, blocks, location, true);
+}
+
+
+static AESNI_TARGET void xts_decrypt_aesni (uint8_t *dst, uint8_t const data_keys[static 240], uint8_t const tweak_keys[static 240], uint8_t const *src, size_t blocks, uint64_t location)
+{
+	xts_aesni (dst, data_keys, tweak_keys, src, blocks, location, false);
+}
+#endif
+
+
+void mdbc_aes256_xts_encrypt (void *dst, uint8_t const data_keys[static 240], uint8_t const tweak_keys[static 240], void const *src, size_t blocks, uint64_t location)
+{
+#if AES_X86
+	if (__builtin_cpu_supports ("aes"))
+		xts_encrypt_aesni (dst, data_keys, tweak_keys, src, blocks, location);
+	else
+#endif
+		xts_c (dst, data_keys, tweak_keys, src, blocks, location, true);
+}
+
+
+void mdbc_aes256_xts_decrypt (void *dst, uint8_t const data_keys[static 240], uint8_t const tweak_keys[static 240], void const *src, size_t blocks, uint64_t location)
+{
+#if AES_X86
+	if (__builtin_cpu_supports ("aes"))
+		xts_decrypt_aesni (dst, data_keys, tweak_keys, src, blocks, location);
+	else
+#endif
+		xts_c (dst, data_keys, tweak_keys, src, blocks, location, false);
+}
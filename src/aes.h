@@ -0,0 +1,25 @@
+#ifndef __MEAGER_DB_AES_H__
+#define __MEAGER_DB_AES_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/* AES-256 key schedule: 15 round keys, in the byte order of FIPS-197 (and of AES-NI) */
+void mdbc_aes256_expand_key (uint8_t round_keys[static 240], uint8_t const key[static 32]);
+
+/* Round keys for the equivalent inverse cipher (FIPS-197 5.3.5), in the order they are used */
+void mdbc_aes256_inverse_keys (uint8_t decrypt_keys[static 240], uint8_t const encrypt_keys[static 240]);
+
+
+/*
+ * AES-256-XTS (IEEE 1619) over `blocks` 16-byte blocks, as one data unit whose number is
+ * `location` (little-endian, zero padded to 16 bytes).  `data_keys` are the round keys of the first
+ * half of the XTS key (as inverse keys when decrypting), and `tweak_keys` those of the second half.
+ * Uses AES-NI when the CPU has it.
+ * Must be able to *crypt in-place.
+ */
+void mdbc_aes256_xts_encrypt (void *dst, uint8_t const data_keys[static 240], uint8_t const tweak_keys[static 240], void const *src, size_t blocks, uint64_t location);
+void mdbc_aes256_xts_decrypt (void *dst, uint8_t const data_keys[static 240], uint8_t const tweak_keys[static 240], void const *src, size_t blocks, uint64_t location);
+
+#endif
@@ -0,0 +1,699 @@
+/*
+ * Reference implementation of the application layer (app.h) for Linux.
+ * Build it into the library with `make APP=linux`, or copy it into the application.  Link with
+ * -pthread.
+ *
+ * Define MDBA_LINUX_MMAP (e.g. `make APP=linux CCFLAGS=-DMDBA_LINUX_MMAP`) to read pages through
+ * a memory mapping of the database file instead of with pread.
+ *
+ * Define MDBA_LINUX_URING to implement mdba_prefetch with io_uring: read-ahead hints are queued
+ * as asynchronous reads (at most MDBA_LINUX_URING_DEPTH at once), and the pread that follows is
+ * served from the finished read.  Without io_uring support in the kernel, hints are ignored.
+ */
+#define _GNU_SOURCE
+#include <meagerdb/app.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef MDBA_LINUX_URING
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#endif
+
+
+/* Batches longer than this are written with several calls */
+#define MAX_IOVECS 16
+
+/* Number of files that can be mapped at once; others are read with pread */
+#define MAX_MAPPINGS 8
+
+/* Threads started by mdba_parallel; the rest of the calls run on the calling thread */
+#define MAX_THREADS 64
+
+
+#ifdef MDBA_LINUX_MMAP
+static struct
+{
+	int fd;
+	uint8_t *base;
+	size_t len;       /* Length of the mapping, which reaches past the end of the file */
+	size_t size;      /* How much of the mapping the file covered when last checked */
+} mappings[MAX_MAPPINGS];
+
+
+static void unmap_file (int fd)
+{
+	for (int i = 0; i < MAX_MAPPINGS; ++i)
+	{
+		if (mappings[i].base && mappings[i].fd == fd)
+		{
+			munmap (mappings[i].base, mappings[i].len);
+			mappings[i].base = NULL;
+			mappings[i].len = 0;
+			mappings[i].size = 0;
+		}
+	}
+}
+
+
+void const *mdba_map (int fd, uint64_t offset, size_t count)
+{
+	struct stat st;
+	int slot = -1;
+
+	if (offset + count < offset)
+		return NULL;
+
+	for (int i = 0; i < MAX_MAPPINGS; ++i)
+	{
+		if (mappings[i].base && mappings[i].fd == fd)
+		{
+			if (offset + count <= mappings[i].size)
+				return mappings[i].base + offset;
+
+			slot = i;
+			break;
+		}
+		else if (!mappings[i].base && slot == -1)
+			slot = i;
+	}
+
+	if (slot == -1)
+		return NULL;
+
+	/* Not mapped yet, or past what the file covered.  Writes go through the page cache, which a
+	 * shared mapping sees, and so does the part of the mapping past the end of the file once the
+	 * file grows into it.  Only the file's current size may be read, though. */
+	if (fstat (fd, &st) || (uint64_t)st.st_size < offset + count || (uint64_t)st.st_size > SIZE_MAX / 2)
+		return NULL;
+
+	if (mappings[slot].base && (size_t)st.st_size <= mappings[slot].len)
+	{
+		mappings[slot].size = (size_t)st.st_size;
+		return mappings[slot].base + offset;
+	}
+
+	if (mappings[slot].base)
+	{
+		munmap (mappings[slot].base, mappings[slot].len);
+		mappings[slot].base = NULL;
+	}
+
+	/* Twice the file's size, so a growing file is only mapped again each time it doubles */
+	size_t len = 2 * (size_t)st.st_size;
+	void *base = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (base == MAP_FAILED)
+		return NULL;
+
+	mappings[slot].fd = fd;
+	mappings[slot].base = base;
+	mappings[slot].len = len;
+	mappings[slot].size = (size_t)st.st_size;
+
+	return mappings[slot].base + offset;
+}
+#endif
+
+
+#ifdef MDBA_LINUX_URING
+#ifndef MDBA_LINUX_URING_DEPTH
+#define MDBA_LINUX_URING_DEPTH 32
+#endif
+
+enum {
+	SLOT_FREE = 0,
+	SLOT_QUEUED,      /* Waiting in the submission queue */
+	SLOT_INFLIGHT,
+	SLOT_DONE,
+};
+
+/* The ring is set up on the first hint, and lives until the process exits */
+static struct
+{
+	int fd;           /* -1 before setup; -2 if io_uring isn't available */
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Slots queued but not submitted yet, in submission order */
+	unsigned queued[MDBA_LINUX_URING_DEPTH];
+	unsigned queued_count;
+} ring = { .fd = -1 };
+
+/* One asynchronous read, and its own buffer */
+static struct
+{
+	uint8_t state;
+	int fd;
+	uint64_t offset;
+	size_t count;
+	int32_t result;
+	uint8_t *buf;
+	size_t buf_size;
+} slots[MDBA_LINUX_URING_DEPTH];
+
+static unsigned next_slot;
+
+/* mdba_pread may be called on several threads at once (see mdba_parallel) */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static bool ring_setup (void)
+{
+	struct io_uring_params p;
+
+	if (ring.fd != -1)
+		return ring.fd >= 0;
+
+	ring.fd = -2;
+	memset (&p, 0, sizeof (p));
+
+	int fd = (int)syscall (__NR_io_uring_setup, MDBA_LINUX_URING_DEPTH, &p);
+
+	if (fd < 0)
+		return false;
+
+	size_t sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	size_t sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+
+	if (single)
+		sq_len = cq_len = (sq_len > cq_len) ? sq_len : cq_len;
+
+	uint8_t *sq = mmap (NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	uint8_t *cq = sq;
+	void *sqes = MAP_FAILED;
+
+	if (sq != MAP_FAILED && !single)
+		cq = mmap (NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+
+	if (sq != MAP_FAILED && cq != MAP_FAILED)
+		sqes = mmap (NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+	if (sqes == MAP_FAILED)
+	{
+		if (cq != MAP_FAILED && cq != sq)
+			munmap (cq, cq_len);
+		if (sq != MAP_FAILED)
+			munmap (sq, sq_len);
+		close (fd);
+		return false;
+	}
+
+	ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring.sqes = sqes;
+	ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ring.fd = fd;
+
+	return true;
+}
+
+
+/* Hand the queued reads to the kernel and/or wait for `wait` completions. */
+static int ring_enter (unsigned wait)
+{
+	while (1)
+	{
+		unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+		int r = (int)syscall (__NR_io_uring_enter, ring.fd, ring.queued_count, wait, flags, NULL, 0);
+
+		if (r == -1 && errno == EINTR)
+			continue;
+
+		if (r == -1)
+			return -1;
+
+		/* The kernel consumes the submission queue in order */
+		for (unsigned i = 0; i < (unsigned)r && i < ring.queued_count; ++i)
+			slots[ring.queued[i]].state = SLOT_INFLIGHT;
+
+		if ((unsigned)r < ring.queued_count)
+			memmove (ring.queued, ring.queued + r, (ring.queued_count - (unsigned)r) * sizeof (ring.queued[0]));
+		ring.queued_count -= ((unsigned)r < ring.queued_count) ? (unsigned)r : ring.queued_count;
+
+		return 0;
+	}
+}
+
+
+static void ring_submit (void)
+{
+	if (ring.queued_count == 0)
+		return;
+
+	ring_enter (0);
+
+	if (ring.queued_count == 0)
+		return;
+
+	/* The rest wasn't submitted (they're last in the queue); take them back out, and forget them */
+	__atomic_store_n (ring.sq_tail, *ring.sq_tail - ring.queued_count, __ATOMIC_RELEASE);
+
+	for (unsigned i = 0; i < ring.queued_count; ++i)
+		slots[ring.queued[i]].state = SLOT_FREE;
+
+	ring.queued_count = 0;
+}
+
+
+static void ring_reap (void)
+{
+	unsigned head = *ring.cq_head;
+	unsigned tail = __atomic_load_n (ring.cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; ++head)
+	{
+		struct io_uring_cqe const *cqe = &ring.cqes[head & *ring.cq_mask];
+
+		slots[cqe->user_data].result = cqe->res;
+		slots[cqe->user_data].state = SLOT_DONE;
+	}
+
+	__atomic_store_n (ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+/* Wait for the read in `slot` to finish.  The kernel owns its buffer until then. */
+static void ring_wait (unsigned slot)
+{
+	ring_submit ();
+	ring_reap ();
+
+	while (slots[slot].state == SLOT_INFLIGHT)
+	{
+		if (ring_enter (1))
+			mdba_fatal_error ();
+
+		ring_reap ();
+	}
+}
+
+
+/* Forget the reads of `fd` that overlap [offset, offset + count), so they can't be served stale */
+static void ring_drop (int fd, uint64_t offset, uint64_t count)
+{
+	if (ring.fd < 0)
+		return;
+
+	for (unsigned i = 0; i < MDBA_LINUX_URING_DEPTH; ++i)
+	{
+		if (slots[i].state == SLOT_FREE || slots[i].fd != fd)
+			continue;
+
+		if (slots[i].offset >= offset + count || offset >= slots[i].offset + slots[i].count)
+			continue;
+
+		ring_wait (i);
+		slots[i].state = SLOT_FREE;
+	}
+}
+
+
+/* Copy the finished read of exactly this range into `buf`.  Returns 0 on success. */
+static int ring_take (int fd, void *buf, size_t count, uint64_t offset)
+{
+	if (ring.fd < 0)
+		return -1;
+
+	for (unsigned i = 0; i < MDBA_LINUX_URING_DEPTH; ++i)
+	{
+		if (slots[i].state == SLOT_FREE || slots[i].fd != fd || slots[i].offset != offset || slots[i].count != count)
+			continue;
+
+		ring_wait (i);
+		slots[i].state = SLOT_FREE;
+
+		if (slots[i].result < 0 || (size_t)slots[i].result != count)
+			return -1;
+
+		memcpy (buf, slots[i].buf, count);
+		return 0;
+	}
+
+	return -1;
+}
+
+
+static void ring_prefetch (int fd, uint64_t offset, size_t count)
+{
+	unsigned slot = MDBA_LINUX_URING_DEPTH;
+
+	if (count == 0 || count > INT32_MAX || !ring_setup ())
+		return;
+
+	for (unsigned i = 0; i < MDBA_LINUX_URING_DEPTH; ++i)
+	{
+		if (slots[i].state != SLOT_FREE && slots[i].fd == fd && slots[i].offset == offset && slots[i].count == count)
+			return;
+	}
+
+	ring_reap ();
+
+	/* Reads that finished but were never asked for are overwritten first-come first-served */
+	for (unsigned i = 0; i < MDBA_LINUX_URING_DEPTH && slot == MDBA_LINUX_URING_DEPTH; ++i)
+	{
+		unsigned s = (next_slot + i) % MDBA_LINUX_URING_DEPTH;
+
+		if (slots[s].state == SLOT_FREE || slots[s].state == SLOT_DONE)
+			slot = s;
+	}
+
+	/* All reads are still in flight; it's only a hint */
+	if (slot == MDBA_LINUX_URING_DEPTH)
+		return;
+
+	if (slots[slot].buf_size < count)
+	{
+		uint8_t *buf = realloc (slots[slot].buf, count);
+
+		if (buf == NULL)
+			return;
+
+		slots[slot].buf = buf;
+		slots[slot].buf_size = count;
+	}
+
+	slots[slot].state = SLOT_QUEUED;
+	slots[slot].fd = fd;
+	slots[slot].offset = offset;
+	slots[slot].count = count;
+	slots[slot].result = -1;
+	next_slot = (slot + 1) % MDBA_LINUX_URING_DEPTH;
+
+	unsigned tail = *ring.sq_tail;
+	unsigned index = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[index];
+
+	memset (sqe, 0, sizeof (*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = (uintptr_t)slots[slot].buf;
+	sqe->len = (uint32_t)count;
+	sqe->user_data = slot;
+	ring.sq_array[index] = index;
+	ring.queued[ring.queued_count++] = slot;
+
+	__atomic_store_n (ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	/* Submitted along with the hints that follow, on the next call that does I/O */
+}
+
+
+void mdba_prefetch (int fd, uint64_t offset, size_t count)
+{
+	pthread_mutex_lock (&ring_lock);
+	ring_prefetch (fd, offset, count);
+	pthread_mutex_unlock (&ring_lock);
+}
+
+
+static int ring_read (int fd, void *buf, size_t count, uint64_t offset)
+{
+	pthread_mutex_lock (&ring_lock);
+
+	int r = ring_take (fd, buf, count, offset);
+
+	if (r)
+		ring_submit ();
+
+	pthread_mutex_unlock (&ring_lock);
+
+	return r;
+}
+
+
+static void ring_forget (int fd, uint64_t offset, uint64_t count)
+{
+	pthread_mutex_lock (&ring_lock);
+	ring_drop (fd, offset, count);
+	pthread_mutex_unlock (&ring_lock);
+}
+#endif
+
+
+int mdba_open (char const *path, int flags)
+{
+	int fd;
+
+	do
+	{
+		fd = open (path, flags | O_CLOEXEC, 0600);
+	} while (fd == -1 && errno == EINTR);
+
+	return fd;
+}
+
+
+int mdba_close (int fd)
+{
+#ifdef MDBA_LINUX_MMAP
+	unmap_file (fd);
+#endif
+#ifdef MDBA_LINUX_URING
+	ring_forget (fd, 0, UINT64_MAX);
+#endif
+
+	return close (fd);
+}
+
+
+int mdba_read (int fd, void *buf, size_t count)
+{
+	while (count)
+	{
+		ssize_t r = read (fd, buf, count);
+
+		if (r == -1 && errno == EINTR)
+			continue;
+
+		if (r <= 0)
+			return -1;
+
+		buf = (uint8_t *)buf + r;
+		count -= (size_t)r;
+	}
+
+	return 0;
+}
+
+
+int mdba_write (int fd, void const *buf, size_t count)
+{
+#ifdef MDBA_LINUX_URING
+	/* The file position isn't known here */
+	ring_forget (fd, 0, UINT64_MAX);
+#endif
+
+	while (count)
+	{
+		ssize_t r = write (fd, buf, count);
+
+		if (r == -1 && errno == EINTR)
+			continue;
+
+		if (r <= 0)
+			return -1;
+
+		buf = (uint8_t const *)buf + r;
+		count -= (size_t)r;
+	}
+
+	return 0;
+}
+
+
+int mdba_lseek (int fd, uint64_t offset, int whence)
+{
+	return (lseek (fd, (off_t)offset, whence) == (off_t)-1) ? -1 : 0;
+}
+
+
+int mdba_fsync (int fd)
+{
+	int r;
+
+	do
+	{
+		r = fdatasync (fd);
+	} while (r == -1 && errno == EINTR);
+
+	return r ? -1 : 0;
+}
+
+
+int mdba_pread (int fd, void *buf, size_t count, uint64_t offset)
+{
+#ifdef MDBA_LINUX_URING
+	if (ring_read (fd, buf, count, offset) == 0)
+		return 0;
+#endif
+
+	while (count)
+	{
+		ssize_t r = pread (fd, buf, count, (off_t)offset);
+
+		if (r == -1 && errno == EINTR)
+			continue;
+
+		if (r <= 0)
+			return -1;
+
+		buf = (uint8_t *)buf + r;
+		count -= (size_t)r;
+		offset += (uint64_t)r;
+	}
+
+	return 0;
+}
+
+
+int mdba_pwritev (int fd, MDBA_IOVEC const *iov, int iovcnt, uint64_t offset)
+{
+	struct iovec vec[MAX_IOVECS];
+	size_t skip = 0;   /* Bytes of iov[0] already written */
+
+#ifdef MDBA_LINUX_URING
+	uint64_t total = 0;
+
+	for (int i = 0; i < iovcnt; ++i)
+		total += iov[i].len;
+
+	ring_forget (fd, offset, total);
+#endif
+
+	while (1)
+	{
+		/* Drop the buffers that are done; a short write resumes in the middle of one */
+		while (iovcnt > 0 && skip >= iov[0].len)
+		{
+			skip -= iov[0].len;
+			iov += 1;
+			iovcnt -= 1;
+		}
+
+		if (iovcnt <= 0)
+			return 0;
+
+		int n = (iovcnt < MAX_IOVECS) ? iovcnt : MAX_IOVECS;
+
+		for (int i = 0; i < n; ++i)
+		{
+			vec[i].iov_base = (uint8_t *)(uintptr_t)iov[i].base;
+			vec[i].iov_len = iov[i].len;
+		}
+
+		vec[0].iov_base = (uint8_t *)vec[0].iov_base + skip;
+		vec[0].iov_len -= skip;
+
+		ssize_t r = pwritev (fd, vec, n, (off_t)offset);
+
+		if (r == -1 && errno == EINTR)
+			continue;
+
+		if (r <= 0)
+			return -1;
+
+		offset += (uint64_t)r;
+		skip += (size_t)r;
+	}
+}
+
+
+typedef struct
+{
+	pthread_t thread;
+	void (*fn) (void *arg, uint32_t i);
+	void *arg;
+	uint32_t i;
+} WORKER;
+
+
+static void *run_worker (void *p)
+{
+	WORKER const *worker = p;
+
+	worker->fn (worker->arg, worker->i);
+
+	return NULL;
+}
+
+
+void mdba_parallel (void (*fn) (void *arg, uint32_t i), void *arg, uint32_t count)
+{
+	WORKER workers[MAX_THREADS];
+	uint32_t started = 0;
+
+	/* Call 0 runs on this thread, as do any that a thread can't be started for */
+	for (uint32_t i = 1; i < count; ++i)
+	{
+		if (started < MAX_THREADS)
+		{
+			WORKER *worker = &workers[started];
+
+			worker->fn = fn;
+			worker->arg = arg;
+			worker->i = i;
+
+			if (pthread_create (&worker->thread, NULL, run_worker, worker) == 0)
+			{
+				started += 1;
+				continue;
+			}
+		}
+
+		fn (arg, i);
+	}
+
+	fn (arg, 0);
+
+	for (uint32_t i = 0; i < started; ++i)
+		pthread_join (workers[i].thread, NULL);
+}
+
+
+void mdba_read_urandom (void *dst, size_t len)
+{
+	while (len)
+	{
+		ssize_t r = getrandom (dst, len, 0);
+
+		if (r == -1 && errno == EINTR)
+			continue;
+
+		if (r <= 0)
+			mdba_fatal_error ();
+
+		dst = (uint8_t *)dst + r;
+		len -= (size_t)r;
+	}
+}
+
+
+void mdba_fatal_error (void)
+{
+	fputs ("meagerdb: fatal error\n", stderr);
+	abort ();
+}
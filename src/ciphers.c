@@ -1,72 +1,137 @@
 #include "ciphers.h"
-#include <strong-arm/hmac.h>
-#include <strong-arm/threefish.h>
-#include <strong-arm/pbkdf2.h>
-#include <strong-arm/sha256.h>
+#include <string.h>
+#include "threefish.h"
+#include "aes.h"
+#include "sha2.h"
+#include "crc32c.h"
 #include <meagerdb/app.h>
 #include "basic_packing.h"
 
 
-void mdbc_encrypt (void *dst, uint8_t const keys[static 128], void const *src, size_t len, uint64_t location)
+static char const *const CIPHERSUITES[] = {
+	[MDBC_THREEFISH] = MDB_CIPHERSUITE_THREEFISH,
+	[MDBC_AES] = MDB_CIPHERSUITE_AES,
+	[MDBC_PLAINTEXT] = MDB_CIPHERSUITE_PLAINTEXT,
+};
+
+
+int mdbc_find_ciphersuite (uint8_t const name[static 32])
+{
+	for (int suite = 0; suite < (int)(sizeof (CIPHERSUITES) / sizeof (CIPHERSUITES[0])); ++suite)
+	{
+		uint8_t padded[32] = {0};
+
+		memmove (padded, CIPHERSUITES[suite], strlen (CIPHERSUITES[suite]));
+
+		if (!memcmp (padded, name, 32))
+			return suite;
+	}
+
+	return -1;
+}
+
+
+void mdbc_expand_keys (MDB_CIPHER_KEYS *expanded, int suite, uint8_t const keys[static 128])
 {
-	uint8_t tweak[16] = {0};
-	uint32_t block_num = 0;
+	expanded->suite = (uint8_t)suite;
+
+	if (suite == MDBC_AES)
+	{
+		mdbc_aes256_expand_key (expanded->cipher.aes.encrypt, keys);
+		mdbc_aes256_inverse_keys (expanded->cipher.aes.decrypt, expanded->cipher.aes.encrypt);
+		mdbc_aes256_expand_key (expanded->cipher.aes.tweak, keys + 32);
+	}
+	else if (suite == MDBC_THREEFISH)
+		mdbc_threefish_expand_key (expanded->cipher.threefish, keys);
+
+	mdbc_hmac_sha256_init (expanded->hmac_inner, expanded->hmac_outer, keys + 64, 64);
+	expanded->crc_key = mdbc_crc32c (0, keys + 64, 64);
+}
+
 
+void mdbc_encrypt (void *dst, MDB_CIPHER_KEYS const *keys, void const *src, size_t len, uint64_t location)
+{
 	if ((len & 63) != 0)
 		mdba_fatal_error ();
 
 	if ((len >> 6) >= 0xFFFFFFFF)
 		mdba_fatal_error ();
 
-	// Calculate initial tweak
-	pack_uint64_little (tweak, location);
-
-	// Encrypt blocks
-	for (size_t remaining = len >> 6; remaining; --remaining)
+	if (keys->suite == MDBC_PLAINTEXT)
 	{
-		pack_uint32_little (tweak+8, block_num);
-		threefish512_encrypt_block (dst, keys, tweak, src);
+		if (dst != src)
+			memmove (dst, src, len);
+		return;
+	}
 
-		block_num += 1;
-		src = (uint8_t const *)src + 64;
-		dst = (uint8_t *)dst + 64;
+	if (keys->suite == MDBC_AES)
+	{
+		// One XTS data unit, numbered by location
+		mdbc_aes256_xts_encrypt (dst, keys->cipher.aes.encrypt, keys->cipher.aes.tweak, src, len >> 4, location);
+		return;
 	}
+
+	// Every block has its own tweak (location, block number), so they're processed several at once
+	mdbc_threefish_encrypt (dst, keys->cipher.threefish, src, (uint32_t)(len >> 6), location);
 }
 
 
-void mdbc_decrypt (void *dst, uint8_t const keys[static 128], void const *src, size_t len, uint64_t location)
+void mdbc_decrypt (void *dst, MDB_CIPHER_KEYS const *keys, void const *src, size_t len, uint64_t location)
 {
-	uint8_t tweak[16] = {0};
-	uint32_t block_num = 0;
-
 	if ((len & 63) != 0)
 		mdba_fatal_error ();
 
 	if ((len >> 6) >= 0xFFFFFFFF)
 		mdba_fatal_error ();
 
-	// Calculate initial tweak
-	pack_uint64_little (tweak, location);
+	if (keys->suite == MDBC_PLAINTEXT)
+	{
+		if (dst != src)
+			memmove (dst, src, len);
+		return;
+	}
 
-	// Encrypt blocks
-	for (uint32_t remaining = len >> 6; remaining; --remaining)
+	if (keys->suite == MDBC_AES)
 	{
-		pack_uint32_little (tweak+8, block_num);
-		threefish512_decrypt_block (dst, keys, tweak, src);
+		// One XTS data unit, numbered by location
+		mdbc_aes256_xts_decrypt (dst, keys->cipher.aes.decrypt, keys->cipher.aes.tweak, src, len >> 4, location);
+		return;
+	}
+
+	// Every block has its own tweak (location, block number), so they're processed several at once
+	mdbc_threefish_decrypt (dst, keys->cipher.threefish, src, (uint32_t)(len >> 6), location);
+}
 
-		block_num += 1;
-		src = (uint8_t const *)src + 64;
-		dst = (uint8_t *)dst + 64;
+
+void mdbc_mac (void *dst, MDB_CIPHER_KEYS const *keys, void const *src, size_t len)
+{
+	mdbc_hmac_sha256 (dst, keys->hmac_inner, keys->hmac_outer, src, len);
+}
+
+
+void mdbc_page_mac (void *dst, MDB_CIPHER_KEYS const *keys, void const *src, size_t len)
+{
+	if (keys->suite == MDBC_PLAINTEXT)
+	{
+		memset (dst, 0, 32);
+		pack_uint32_little (dst, mdbc_crc32c (keys->crc_key, src, len));
+		return;
 	}
+
+	mdbc_mac (dst, keys, src, len);
 }
 
 
-void mdbc_mac (void *dst, uint8_t const keys[128], void const *src, size_t len)
+void mdbc_page_mac_multi (void *const dst[], MDB_CIPHER_KEYS const *keys, void const *const src[], size_t len, size_t count)
 {
-	if (len > 0xffffffff)
-		mdba_fatal_error ();
+	if (keys->suite == MDBC_PLAINTEXT)
+	{
+		for (size_t i = 0; i < count; ++i)
+			mdbc_page_mac (dst[i], keys, src[i], len);
+		return;
+	}
 
-	HMAC (dst, keys + 64, 64, src, (uint32_t)len);
+	mdbc_hmac_sha256_multi (dst, keys->hmac_inner, keys->hmac_outer, src, len, count);
 }
 
 
@@ -80,7 +145,7 @@ void mdbc_kdf (void *derived_key, void const *password, size_t password_len, voi
 	if (iterations > 0xffffffff)
 		mdba_fatal_error ();
 
-	PBKDF2 (derived_key, password, (uint32_t)password_len, salt, (uint32_t)salt_len, (uint32_t)iterations, derived_len);
+	mdbc_pbkdf2_hmac_sha256 (derived_key, password, password_len, salt, salt_len, (uint32_t)iterations, derived_len);
 }
 
 
@@ -89,5 +154,5 @@ void mdbc_hash (void *dst, void const *message, size_t message_len)
 	if (message_len > 0xffffffff)
 		mdba_fatal_error ();
 
-	SHA256 (dst, message, (uint32_t)message_len);
+	mdbc_sha256 (dst, message, message_len);
 }
@@ -3,13 +3,26 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <meagerdb/meagerdb.h>
 
-#define MDBC_CIPHERSUITE "Threefish-512:SHA-256:HMAC"
+/* Supported ciphersuites.  All of them work in 64-byte units, so pages are laid out the same way. */
+enum {
+	MDBC_THREEFISH = 0,        /* MDB_CIPHERSUITE_THREEFISH */
+	MDBC_AES = 1,              /* MDB_CIPHERSUITE_AES */
+	MDBC_PLAINTEXT = 2,        /* MDB_CIPHERSUITE_PLAINTEXT */
+};
+
+#define MDBC_CIPHERSUITE MDB_CIPHERSUITE_THREEFISH
 #define MDBC_ENCRYPTION_BLOCK_SIZE 64
 
 #define MDBC_KDF "PBKDF2-HMAC-SHA-256"
 
 
+/* Returns the MDBC_* ciphersuite with the given name, or -1 if it isn't supported.  `name` is
+ * the ciphersuite field of the database header, zero padded. */
+int mdbc_find_ciphersuite (uint8_t const name[static 32]);
+
+
 /* Size of MAC tag and HASH tag is fixed at 32 bytes.
  * If the ciphersuite uses less, just pad/ignore.
  * If the ciphersuite uses more, why are your tags so big!?
@@ -17,19 +30,39 @@
 
 
 /* 
- * `location` should be the byte position of the data in the database file.  We use it as part of the encryption
- * tweak.
- * Must be able to *crypt in-place.
  * `keys` is a chunk of bytes containing both the encryption and mac keys.  It is up to the ciphersuite
  * implementation to decide how to split them up.  e.g. in Threefish-512:SHA-256:HMAC the first
- * 64 bytes is the encryption key, and the remaining 64 bytes is the mac key. So these functions
- * would only use the first 64 bytes, and the mac function would only use the last 64 bytes of `keys`.
+ * 64 bytes is the encryption key, and the remaining 64 bytes is the mac key (AES-256-XTS:SHA-256:HMAC
+ * splits the first 64 bytes into the XTS data and tweak keys, and Plaintext:SHA-256:CRC32C ignores
+ * them). So the encryption functions would only use the first 64 bytes, and the mac function would
+ * only use the last 64 bytes of `keys`.
+ *
+ * mdbc_expand_keys runs the key schedules (and absorbs the HMAC pad blocks), so they aren't
+ * repeated for every page.  The result must be wiped when no longer needed.
  */
-void mdbc_encrypt (void *dst, uint8_t const keys[static 128], void const *src, size_t len, uint64_t location);
-void mdbc_decrypt (void *dst, uint8_t const keys[static 128], void const *src, size_t len, uint64_t location);
+void mdbc_expand_keys (MDB_CIPHER_KEYS *expanded, int suite, uint8_t const keys[static 128]);
+
+
+/* 
+ * `location` should be the byte position of the data in the database file.  We use it as part of the encryption
+ * tweak.  MDBC_PLAINTEXT just copies.
+ * Must be able to *crypt in-place.
+ */
+void mdbc_encrypt (void *dst, MDB_CIPHER_KEYS const *keys, void const *src, size_t len, uint64_t location);
+void mdbc_decrypt (void *dst, MDB_CIPHER_KEYS const *keys, void const *src, size_t len, uint64_t location);
+
+
+/* HMAC-SHA-256, whatever the ciphersuite, using the MAC key state precomputed by mdbc_expand_keys.
+ * Authenticates the Encryption Parameters, and so the password. */
+void mdbc_mac (void *dst, MDB_CIPHER_KEYS const *keys, void const *src, size_t len);
 
+/* The ciphersuite's tag for a page: mdbc_mac, or for MDBC_PLAINTEXT a CRC-32C (little-endian,
+ * then zeros) of the MAC key and the page.  A checksum only catches accidental damage. */
+void mdbc_page_mac (void *dst, MDB_CIPHER_KEYS const *keys, void const *src, size_t len);
 
-void mdbc_mac (void *dst, uint8_t const keys[128], void const *src, size_t len);
+/* mdbc_page_mac of `count` messages of `len` bytes each, into dst[i].  Eight of them are
+ * authenticated at once in vector lanes, when that is faster on this CPU than one after the other. */
+void mdbc_page_mac_multi (void *const dst[], MDB_CIPHER_KEYS const *keys, void const *const src[], size_t len, size_t count);
 
 
 /* 
@@ -0,0 +1,14 @@
+#ifndef __MEAGER_DB_CRC32C_H__
+#define __MEAGER_DB_CRC32C_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/*
+ * CRC-32C (Castagnoli), continuing from `crc`: start with 0, and pass the result of one call to
+ * the next to checksum data in pieces.  Uses the SSE4.2 crc32 instruction when the CPU has it.
+ */
+uint32_t mdbc_crc32c (uint32_t crc, void const *data, size_t len);
+
+#endif
@@ -6,6 +6,38 @@
 #include "util.h"
 
 
+/*
+ * A row holds either Key-Value Chunks, ended by an empty key, or a Key-Value Directory: an empty
+ * key, DIRECTORY_MARK and the number of keys, then a sorted list of (key, value offset, value
+ * length), then the values.  mdbk_update writes a directory, so a key can be found by binary
+ * search, except in version 1.0 databases.  See database-specification.md.
+ */
+#define CHUNK_HEADER (MDBK_KEY_LEN + 4)
+#define DIRECTORY_HEADER (MDBK_KEY_LEN + 8)
+#define DIRECTORY_ENTRY (MDBK_KEY_LEN + 8)
+#define DIRECTORY_MARK 0xFFFFFFFF
+
+/* Keys read at once while updating.  Chunk rows aren't sorted, and there's no memory to sort all
+ * of their keys at once; each scan of the chunks sorts this many. */
+#define SORT_BATCH 16
+
+/* A key of the selected row, or of an update */
+typedef struct
+{
+	uint8_t key[MDBK_KEY_LEN];
+	uint32_t offset;                      /* Where its value starts in the row */
+	uint32_t valuelen;
+	MDBK_UPDATE_ENTRY const *update;      /* The update it comes from, or NULL */
+} KV_ENTRY;
+
+/* How the selected row is encoded */
+typedef struct
+{
+	bool directory;
+	uint32_t count;                       /* Number of keys in the directory */
+} KV_ROW;
+
+
 static bool is_empty_key (uint8_t const key[static MDBK_KEY_LEN])
 {
 	uint8_t const *ptr = key;
@@ -20,149 +52,482 @@ static bool is_empty_key (uint8_t const key[static MDBK_KEY_LEN])
 }
 
 
-_Static_assert (MDBK_KEY_LEN < (0xFFFFFFFF-4), "MDBK_KEY_LEN too big.");
+static int read_format (MDB *db, KV_ROW *row)
+{
+	int err;
+	uint8_t buf[DIRECTORY_HEADER];
+
+	row->directory = false;
+	row->count = 0;
+
+	if ((err = mdb_read_value (db, buf, 0, CHUNK_HEADER)))
+		return err;
 
-int mdbk_update (MDB *db, MDBK_UPDATE_ENTRY const *updates, size_t update_count)
+	if (!is_empty_key (buf) || unpack_uint32_little (buf + MDBK_KEY_LEN) != DIRECTORY_MARK)
+		return 0;
+
+	if ((err = mdb_read_value (db, buf + CHUNK_HEADER, CHUNK_HEADER, DIRECTORY_HEADER - CHUNK_HEADER)))
+		return err;
+
+	row->directory = true;
+	row->count = unpack_uint32_little (buf + CHUNK_HEADER);
+
+	return 0;
+}
+
+
+/* Read `n` entries of the directory, starting with the `idx`th. */
+static int read_entries (MDB *db, uint32_t idx, uint32_t n, KV_ENTRY *entries)
 {
 	int err;
-	uint8_t buf[MAX (32, MDBK_KEY_LEN + 4)];
+	uint8_t buf[SORT_BATCH * DIRECTORY_ENTRY];
+	uint64_t offset = DIRECTORY_HEADER + (uint64_t)idx * DIRECTORY_ENTRY;
+
+	if (n > SORT_BATCH || (offset + (uint64_t)n * DIRECTORY_ENTRY) > 0xFFFFFFFF)
+		return -1;
+
+	if ((err = mdb_read_value (db, buf, (uint32_t)offset, n * DIRECTORY_ENTRY)))
+		return err;
+
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		uint8_t const *ptr = buf + i * DIRECTORY_ENTRY;
+
+		memmove (entries[i].key, ptr, MDBK_KEY_LEN);
+		entries[i].offset = unpack_uint32_little (ptr + MDBK_KEY_LEN);
+		entries[i].valuelen = unpack_uint32_little (ptr + MDBK_KEY_LEN + 4);
+		entries[i].update = NULL;
+	}
+
+	return 0;
+}
+
+
+/* Read the `idx`th entry of the directory. */
+static int read_entry (MDB *db, uint32_t idx, KV_ENTRY *entry)
+{
+	return read_entries (db, idx, 1, entry);
+}
+
+
+/* Index of the first key in the directory that isn't before `key`, or row->count if there is none. */
+static int search_directory (MDB *db, KV_ROW const *row, uint8_t const key[static MDBK_KEY_LEN], uint32_t *idx)
+{
+	int err;
+	uint32_t lo = 0, hi = row->count;
+	KV_ENTRY entry;
+
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if ((err = read_entry (db, mid, &entry)))
+			return err;
+
+		if (memcmp (entry.key, key, MDBK_KEY_LEN) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*idx = lo;
+
+	return 0;
+}
+
+
+/* Read the chunk at `*offset`, and advance `*offset` past it.  An empty key ends the chunks. */
+static int read_chunk (MDB *db, uint32_t *offset, KV_ENTRY *entry)
+{
+	int err;
+	uint8_t buf[CHUNK_HEADER];
+
+	if ((err = mdb_read_value (db, buf, *offset, CHUNK_HEADER)))
+		return err;
+
+	memmove (entry->key, buf, MDBK_KEY_LEN);
+	entry->valuelen = unpack_uint32_little (buf + MDBK_KEY_LEN);
+	entry->update = NULL;
+
+	if ((*offset + CHUNK_HEADER) < *offset)
+		return -1;
+
+	*offset += CHUNK_HEADER;
+	entry->offset = *offset;
+
+	if ((*offset + entry->valuelen) < *offset)
+		return -1;
+
+	*offset += entry->valuelen;
+
+	return 0;
+}
+
+
+/* Find `key` in the selected row.  Sets *found to false if it isn't there. */
+static int find_key (MDB *db, uint8_t const key[static MDBK_KEY_LEN], KV_ENTRY *entry, bool *found)
+{
+	int err;
+	KV_ROW row;
 	uint32_t offset = 0;
-	uint32_t valuelen;
 
-	/* Calculate total length of updated data */
-	uint32_t total_len = (MDBK_KEY_LEN+4) * update_count;
+	*found = false;
 
-	for (size_t i = 0, count = update_count; count; ++i, --count)
+	if ((err = read_format (db, &row)))
+		return err;
+
+	if (row.directory)
 	{
-		if (is_empty_key (updates[i].key))
-			return MDBE_BAD_ARGUMENT;
+		uint32_t idx;
 
-		if (total_len + updates[i].valuelen < total_len)
-			return MDBE_DATA_TOO_BIG;
-		
-		total_len += updates[i].valuelen;
+		if ((err = search_directory (db, &row, key, &idx)))
+			return err;
+
+		if (idx == row.count)
+			return 0;
+
+		if ((err = read_entry (db, idx, entry)))
+			return err;
+
+		*found = !memcmp (entry->key, key, MDBK_KEY_LEN);
+		return 0;
 	}
 
 	while (1)
 	{
-		bool updated = false;
-
-		if ((err = mdb_read_value (db, buf, offset, MDBK_KEY_LEN+4)))
+		if ((err = read_chunk (db, &offset, entry)))
 			return err;
 
-		if (is_empty_key (buf))
+		if (is_empty_key (entry->key))
+			return 0;
+
+		if (!memcmp (entry->key, key, MDBK_KEY_LEN))
 		{
-			if ((total_len + MDBK_KEY_LEN + 4) < total_len)
-				return MDBE_DATA_TOO_BIG;
-			break;
+			*found = true;
+			return 0;
 		}
+	}
+}
+
+
+/* Goes through the keys of the selected row and of the updates together, in sorted order */
+typedef struct
+{
+	KV_ROW row;
+	MDBK_UPDATE_ENTRY const *updates;
+	size_t update_count;
+
+	bool started;
+	uint8_t prev[MDBK_KEY_LEN];           /* The last key returned */
+
+	KV_ENTRY row_next;                    /* The row's next key, if row_ready */
+	bool row_ready;
+	bool row_done;
+
+	uint32_t idx;                         /* Next entry of a directory */
 
-		valuelen = unpack_uint32_little (buf+MDBK_KEY_LEN);
+	KV_ENTRY sorted[SORT_BATCH];          /* Next keys of the row */
+	uint32_t sorted_count;
+	uint32_t sorted_next;
+} KV_MERGE;
 
-		if ((valuelen + MDBK_KEY_LEN + 4) < valuelen)
-			return -1;
 
-		valuelen += MDBK_KEY_LEN + 4;
-		
-		if ((offset + valuelen) < offset)
-			return -1;
+static void merge_start (KV_MERGE *merge, KV_ROW const *row, MDBK_UPDATE_ENTRY const *updates, size_t update_count)
+{
+	memset (merge, 0, sizeof (KV_MERGE));
+	merge->row = *row;
+	merge->updates = updates;
+	merge->update_count = update_count;
+}
+
+
+/* Scan the chunks for the SORT_BATCH smallest keys after the previous batch. */
+static int sort_chunks (MDB *db, KV_MERGE *merge)
+{
+	int err;
+	KV_ENTRY entry;
+	uint8_t after[MDBK_KEY_LEN];
+	bool first = (merge->sorted_count == 0);
+
+	if (!first)
+		memmove (after, merge->sorted[merge->sorted_count - 1].key, MDBK_KEY_LEN);
+
+	merge->sorted_count = 0;
+	merge->sorted_next = 0;
+
+	for (uint32_t offset = 0; ; )
+	{
+		uint32_t pos;
+
+		if ((err = read_chunk (db, &offset, &entry)))
+			return err;
+
+		if (is_empty_key (entry.key))
+			return 0;
+
+		if (!first && memcmp (entry.key, after, MDBK_KEY_LEN) <= 0)
+			continue;
+
+		for (pos = merge->sorted_count; pos > 0 && memcmp (entry.key, merge->sorted[pos - 1].key, MDBK_KEY_LEN) < 0; --pos)
+			;
+
+		/* The first chunk with a key wins, as in find_key */
+		if (pos > 0 && !memcmp (entry.key, merge->sorted[pos - 1].key, MDBK_KEY_LEN))
+			continue;
 
-		offset += valuelen;
+		if (pos == SORT_BATCH)
+			continue;
+
+		if (merge->sorted_count < SORT_BATCH)
+			merge->sorted_count += 1;
 
-		for (size_t i = 0, count = update_count; count; ++i, --count)
+		memmove (merge->sorted + pos + 1, merge->sorted + pos, (merge->sorted_count - 1 - pos) * sizeof (KV_ENTRY));
+		merge->sorted[pos] = entry;
+	}
+}
+
+
+/* Read the row's next key into merge->row_next. */
+static int row_advance (MDB *db, KV_MERGE *merge)
+{
+	int err;
+
+	if (merge->sorted_next == merge->sorted_count)
+	{
+		if (!merge->row.directory)
+			err = sort_chunks (db, merge);
+		else
 		{
-			if (!memcmp (buf, updates[i].key, MDBK_KEY_LEN))
-			{
-				updated = true;
-				break;
-			}
+			merge->sorted_count = MIN (merge->row.count - merge->idx, SORT_BATCH);
+			merge->sorted_next = 0;
+			err = read_entries (db, merge->idx, merge->sorted_count, merge->sorted);
+			merge->idx += merge->sorted_count;
 		}
 
-		if (!updated)
-		{
-			if ((total_len + valuelen) < total_len)
-				return MDBE_DATA_TOO_BIG;
+		if (err)
+			return err;
+	}
 
-			total_len += valuelen;
-		}
+	if (merge->sorted_count == 0)
+	{
+		merge->row_done = true;
+		return 0;
 	}
 
-	/* Begin updating row */
-	if ((err = mdb_update_begin (db, total_len)))
+	merge->row_next = merge->sorted[merge->sorted_next++];
+	merge->row_ready = true;
+
+	return 0;
+}
+
+
+/*
+ * The next key of the selected row and the updates, in sorted order.  An update replaces the row's
+ * key, and the first of several updates to one key wins.  Sets *found to false after the last key.
+ * The row's keys are read in order, once; updates are searched each time.
+ */
+static int merge_next (MDB *db, KV_MERGE *merge, KV_ENTRY *next, bool *found)
+{
+	int err, cmp;
+	MDBK_UPDATE_ENTRY const *update = NULL;
+
+	if (!merge->row_ready && !merge->row_done && (err = row_advance (db, merge)))
 		return err;
 
-	/* Copy new key-value pairs */
-	for (size_t i = 0, count = update_count; count; ++i, --count)
+	for (size_t i = 0; i < merge->update_count; ++i)
 	{
-		memmove (buf, updates[i].key, MDBK_KEY_LEN);
-		pack_uint32_little (buf+MDBK_KEY_LEN, updates[i].valuelen);
+		uint8_t const *key = merge->updates[i].key;
 
-		if ((err = mdb_update_continue (db, buf, MDBK_KEY_LEN + 4)))
-			return err;
+		if (merge->started && memcmp (key, merge->prev, MDBK_KEY_LEN) <= 0)
+			continue;
 
-		if (!updates[i].value)
+		if (update && memcmp (key, update->key, MDBK_KEY_LEN) >= 0)
 			continue;
 
-		if ((err = mdb_update_continue (db, updates[i].value, updates[i].valuelen)))
+		update = &merge->updates[i];
+	}
+
+	if (!merge->row_ready)
+		cmp = 1;
+	else if (!update)
+		cmp = -1;
+	else
+		cmp = memcmp (merge->row_next.key, update->key, MDBK_KEY_LEN);
+
+	/* Returned now, or replaced by the update */
+	if (cmp <= 0)
+		merge->row_ready = false;
+
+	*found = true;
+
+	if (cmp < 0)
+		*next = merge->row_next;
+	else if (update)
+	{
+		memmove (next->key, update->key, MDBK_KEY_LEN);
+		next->offset = 0;
+		next->valuelen = update->valuelen;
+		next->update = update;
+	}
+	else
+	{
+		*found = false;
+		return 0;
+	}
+
+	memmove (merge->prev, next->key, MDBK_KEY_LEN);
+	merge->started = true;
+
+	return 0;
+}
+
+
+/* Continue the update with `len` bytes of the selected row's value from `offset`, or with zeros if
+ * `from_row` is false. */
+static int copy_value (MDB *db, bool from_row, uint32_t offset, uint32_t len)
+{
+	int err;
+	uint8_t buf[128];
+
+	memset (buf, 0, sizeof (buf));
+
+	for (uint32_t done = 0; done < len; )
+	{
+		uint32_t l = MIN (len - done, sizeof (buf));
+
+		if (from_row && (err = mdb_read_value (db, buf, offset + done, l)))
 			return err;
+
+		if ((err = mdb_update_continue (db, buf, l)))
+			return err;
+
+		done += l;
 	}
 
-	/* Copy existing key-value pairs that aren't overwritten */
-	offset = 0;
+	return 0;
+}
 
-	while (1)
+
+_Static_assert (MDBK_KEY_LEN < (0xFFFFFFFF-8), "MDBK_KEY_LEN too big.");
+
+int mdbk_update (MDB *db, MDBK_UPDATE_ENTRY const *updates, size_t update_count)
+{
+	int err;
+	uint8_t buf[DIRECTORY_HEADER];
+	KV_ROW row;
+	KV_MERGE merge;
+	KV_ENTRY entry;
+	bool found;
+	uint32_t count = 0, run_offset = 0, run_len = 0;
+
+	/* Version 1.0 libraries would see a directory as an empty row, and could update it as such */
+	bool directory = (db->version != MDB_VERSION_1_0);
+	uint32_t header = directory ? DIRECTORY_ENTRY : CHUNK_HEADER;
+	uint64_t total_len = directory ? DIRECTORY_HEADER : CHUNK_HEADER;
+
+	for (size_t i = 0; i < update_count; ++i)
 	{
-		bool updated = false;
+		if (is_empty_key (updates[i].key))
+			return MDBE_BAD_ARGUMENT;
+	}
+
+	if ((err = read_format (db, &row)))
+		return err;
+
+	/* Calculate total length of updated data */
+	merge_start (&merge, &row, updates, update_count);
 
-		if ((err = mdb_read_value (db, buf, offset, MDBK_KEY_LEN+4)))
+	while (!(err = merge_next (db, &merge, &entry, &found)) && found)
+	{
+		count += 1;
+		total_len += header + (uint64_t)entry.valuelen;
+
+		if (total_len > 0xFFFFFFFF)
+			return MDBE_DATA_TOO_BIG;
+	}
+
+	if (err)
+		return err;
+
+	/* Begin updating row */
+	if ((err = mdb_update_begin (db, (uint32_t)total_len)))
+		return err;
+
+	/* Directory */
+	if (directory)
+	{
+		uint32_t offset = DIRECTORY_HEADER + count * DIRECTORY_ENTRY;
+
+		memset (buf, 0, MDBK_KEY_LEN);
+		pack_uint32_little (buf + MDBK_KEY_LEN, DIRECTORY_MARK);
+		pack_uint32_little (buf + MDBK_KEY_LEN + 4, count);
+
+		if ((err = mdb_update_continue (db, buf, DIRECTORY_HEADER)))
 			return err;
 
-		if (is_empty_key (buf))
+		merge_start (&merge, &row, updates, update_count);
+
+		while (!(err = merge_next (db, &merge, &entry, &found)) && found)
 		{
-			/* Write terminator */
-			if ((err = mdb_update_continue (db, buf, MDBK_KEY_LEN+4)))
+			memmove (buf, entry.key, MDBK_KEY_LEN);
+			pack_uint32_little (buf + MDBK_KEY_LEN, offset);
+			pack_uint32_little (buf + MDBK_KEY_LEN + 4, entry.valuelen);
+
+			if ((err = mdb_update_continue (db, buf, DIRECTORY_ENTRY)))
 				return err;
-			break;
-		}
 
-		valuelen = unpack_uint32_little (buf+MDBK_KEY_LEN);
+			offset += entry.valuelen;
+		}
 
-		if ((valuelen + MDBK_KEY_LEN + 4) < valuelen)
-			return -1;
+		if (err)
+			return err;
+	}
 
-		valuelen += MDBK_KEY_LEN + 4;
-		
-		if ((offset + valuelen) < offset)
-			return -1;
+	/* Values, each after its chunk header if there's no directory.  Values that follow each other
+	 * in the row are copied together. */
+	merge_start (&merge, &row, updates, update_count);
 
-		for (size_t i = 0, count = update_count; count; ++i, --count)
+	while (!(err = merge_next (db, &merge, &entry, &found)) && found)
+	{
+		if (!directory || entry.update || entry.offset != run_offset + run_len)
 		{
-			if (!memcmp (buf, updates[i].key, MDBK_KEY_LEN))
-			{
-				updated = true;
-				break;
-			}
-		}
+			if ((err = copy_value (db, true, run_offset, run_len)))
+				return err;
 
-		if (updated)
-		{
-			offset += valuelen;
-			continue;
+			run_offset = entry.offset;
+			run_len = 0;
 		}
-		
-		for (uint32_t remaining = valuelen; remaining; )
+
+		if (!directory)
 		{
-			uint32_t l = MIN (remaining, sizeof (buf));
+			memmove (buf, entry.key, MDBK_KEY_LEN);
+			pack_uint32_little (buf + MDBK_KEY_LEN, entry.valuelen);
 
-			if ((err = mdb_read_value (db, buf, offset, l)))
+			if ((err = mdb_update_continue (db, buf, CHUNK_HEADER)))
 				return err;
+		}
 
-			if ((err = mdb_update_continue (db, buf, l)))
-				return err;
+		if (!entry.update)
+			run_len += entry.valuelen;
+		else if (entry.update->value)
+			err = mdb_update_continue (db, entry.update->value, entry.valuelen);
+		else
+			err = copy_value (db, false, 0, entry.valuelen);   /* A NULL value is all zeros */
 
-			remaining -= l;
-			offset += l;
-		}
+		if (err)
+			return err;
+	}
+
+	if (err || (err = copy_value (db, true, run_offset, run_len)))
+		return err;
+
+	/* Terminator */
+	if (!directory)
+	{
+		memset (buf, 0, CHUNK_HEADER);
+
+		if ((err = mdb_update_continue (db, buf, CHUNK_HEADER)))
+			return err;
 	}
 
 	/* Finalize */
@@ -176,77 +541,61 @@ int mdbk_update (MDB *db, MDBK_UPDATE_ENTRY const *updates, size_t update_count)
 int64_t mdbk_get_value (MDB *db, void *dst, uint8_t const key[static MDBK_KEY_LEN], size_t maxlen)
 {
 	int err;
-	uint32_t offset = 0;
-	uint32_t valuelen;
-	uint8_t buf[MDBK_KEY_LEN+4];
+	KV_ENTRY entry;
+	bool found;
 
-	while (1)
-	{
-		if ((err = mdb_read_value (db, buf, offset, MDBK_KEY_LEN+4)))
-			return err;
-
-		if (is_empty_key (buf))
-			return 0;
-
-		valuelen = unpack_uint32_little (buf+MDBK_KEY_LEN);
-
-		if ((offset + MDBK_KEY_LEN + 4) < offset)
-			return -1;
-
-		offset += MDBK_KEY_LEN + 4;
-
-		if (!memcmp (buf, key, MDBK_KEY_LEN))
-		{
-			if (dst)
-			{
-				if (valuelen > maxlen)
-					return MDBE_DATA_TOO_BIG;
+	if ((err = find_key (db, key, &entry, &found)))
+		return err;
 
-				if ((err = mdb_read_value (db, dst, offset, valuelen)))
-					return err;
-			}
+	if (!found)
+		return 0;
 
-			return valuelen;
-		}
-
-		if ((offset + valuelen) < offset)
-			return -1;
+	if (dst)
+	{
+		if (entry.valuelen > maxlen)
+			return MDBE_DATA_TOO_BIG;
 
-		offset += valuelen;
+		if ((err = mdb_read_value (db, dst, entry.offset, entry.valuelen)))
+			return err;
 	}
+
+	return entry.valuelen;
 }
 
 
 int mdbk_read_key (MDB *db, uint8_t dst[static MDBK_KEY_LEN], uint32_t idx)
 {
 	int err;
+	KV_ROW row;
+	KV_ENTRY entry;
 	uint32_t offset = 0;
-	uint32_t valuelen;
-	uint8_t buf[MDBK_KEY_LEN+4];
 
-	for (uint32_t current_idx = 0; ; ++current_idx)
-	{
-		if ((err = mdb_read_value (db, buf, offset, MDBK_KEY_LEN+4)))
-			return err;
+	if ((err = read_format (db, &row)))
+		return err;
 
-		if (is_empty_key (buf))
+	if (row.directory)
+	{
+		if (idx >= row.count)
 			return MDBE_NOT_FOUND;
 
-		valuelen = unpack_uint32_little (buf+MDBK_KEY_LEN);
-
-		if ((offset + MDBK_KEY_LEN + 4) < offset)
-			return -1;
+		if ((err = read_entry (db, idx, &entry)))
+			return err;
 
-		offset += MDBK_KEY_LEN + 4;
+		memmove (dst, entry.key, MDBK_KEY_LEN);
+		return 0;
+	}
 
-		if ((offset + valuelen) < offset)
-			return -1;
+	for (uint32_t current_idx = 0; ; ++current_idx)
+	{
+		if ((err = read_chunk (db, &offset, &entry)))
+			return err;
 
-		offset += valuelen;
+		if (is_empty_key (entry.key))
+			return MDBE_NOT_FOUND;
 
 		if (current_idx == idx)
 		{
-			memmove (dst, buf, MDBK_KEY_LEN);
+			memmove (dst, entry.key, MDBK_KEY_LEN);
 			return 0;
 		}
 	}
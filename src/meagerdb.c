@@ -11,7 +11,50 @@
 
 #define JOURNAL0  0
 #define JOURNAL1  1
-#define FIRST_PAGE 2
+
+/* Journal kinds */
+#define JOURNAL_SPAN     0   /* Nuke a span of pages */
+#define JOURNAL_TRUNCATE 1   /* Journal 0 only: roll back a transaction by ending the database at a page */
+#define JOURNAL_COMMIT   2   /* Journal 1 only: nuke the rows listed in a commit row, then the commit row */
+#define FSM_PAGE  2
+#define ROWID_PAGE 3         /* First of 8 metadata pages holding each table's highest rowid */
+
+#define ROWID_PAGE_TABLES 32
+
+#define INDEX_PAGE 11        /* Primary index state */
+
+/* Rows with this rowid belong to the database itself; their table says what they are */
+#define SYSTEM_ROWID 0xFFFFFFFF
+#define INDEX_TABLE  0       /* Index extent, holding the primary index's nodes */
+#define COMMIT_TABLE 1       /* Rows a transaction deletes when it commits */
+
+#define INDEX_EXTENT_PAGES 64
+
+/* Primary index states */
+#define INDEX_NONE  0        /* Not usable; version 1.0, or damaged */
+#define INDEX_CLEAN 1        /* Saved when the database was closed */
+#define INDEX_DIRTY 2        /* Modified since it was opened */
+
+/* Index node layout: level (0 for leaves), entry count, next node on the level, then entries of
+ * table, rowid, and the row's page (leaves) or the child node's page. */
+#define NODE_HEADER 12
+#define NODE_ENTRY 9
+#define INDEX_MAX_HEIGHT 16
+
+/* Version 1.1 reserves this many metadata pages after the journals; version 1.0 has none. */
+#define META_PAGES 16
+
+#define VERSION_1_0 MDB_VERSION_1_0
+#define VERSION_1_1 MDB_VERSION_1_1
+
+/* Each cache entry is the page number, the CLOCK reference flag, and the page's plaintext.  The
+ * entries are followed by the buckets that find them, each holding an entry's index plus one (0
+ * for an empty bucket), two buckets per entry. */
+#define CACHE_ENTRY_HEADER 8
+#define CACHE_BUCKET 4
+
+/* How many pages ahead of the current one a long read keeps in flight (see mdba_prefetch) */
+#define READ_AHEAD_PAGES 16
 
 #define ERROR_AND_CLOSE_IF(cond,err) if ((cond)) { mdb_close (db); return (err); }
 #define CLOSE_AND_ERROR(err) {mdb_close (db); return (err); }
@@ -50,33 +93,142 @@ _Static_assert (MDB_DEFAULT_PAGE_SIZE <= MDB_MAX_PAGE_SIZE, "MDB_DEFAULT_PAGE_SI
 _Static_assert (MDB_TMP_SIZE >= sizeof (RAW_HEADER), "MDB_MAX_PAGE_SIZE is too small.");
 _Static_assert (MDB_TMP_SIZE >= (sizeof (RAW_PARAMS)+32), "MDB_MAX_PAGE_SIZE is too small.");
 
+/* The free space map and the highest rowids must fit into the smallest page. */
+_Static_assert (ROWID_PAGE_TABLES * 4 <= ((256 - 32) / MDBC_ENCRYPTION_BLOCK_SIZE) * MDBC_ENCRYPTION_BLOCK_SIZE, "ROWID_PAGE_TABLES is too big.");
+_Static_assert (ROWID_PAGE + 256 / ROWID_PAGE_TABLES <= INDEX_PAGE, "Not enough metadata pages.");
+_Static_assert (INDEX_PAGE < FSM_PAGE + META_PAGES, "Not enough metadata pages.");
+_Static_assert (20 <= ((256 - 32) / MDBC_ENCRYPTION_BLOCK_SIZE) * MDBC_ENCRYPTION_BLOCK_SIZE, "Index state doesn't fit.");
+_Static_assert (INDEX_EXTENT_PAGES > INDEX_MAX_HEIGHT + 1, "INDEX_EXTENT_PAGES is too small.");
+_Static_assert (12 + 8 * MDB_FSM_EXTENTS <= ((256 - 32) / MDBC_ENCRYPTION_BLOCK_SIZE) * MDBC_ENCRYPTION_BLOCK_SIZE, "MDB_FSM_EXTENTS is too big.");
+
 /* Necessary to encrypt the key material. */
 _Static_assert ((128 % MDBC_ENCRYPTION_BLOCK_SIZE) == 0, "128 must be a multiple of MDBC_ENCRYPTION_BLOCK_SIZE.");
 
+/* A wrapped key is the encrypted derived keys that open the Encryption Parameters, then their MAC. */
+_Static_assert (MDB_WRAPPED_KEY_SIZE == 128 + 32, "MDB_WRAPPED_KEY_SIZE must match the derived keys.");
+_Static_assert (MDB_WRAPPING_KEY_SIZE == 128, "MDB_WRAPPING_KEY_SIZE must match mdbc_expand_keys.");
+
 
 /* Private Prototypes */
 static int cleanup_journal (MDB *db);
 static int set_journal (MDB *db, int journal, uint32_t page_start, uint32_t page_count);
+static int set_journal_ex (MDB *db, int journal, uint32_t kind, uint32_t page_start, uint32_t page_count);
+static int read_value (MDB *db, uint32_t page_start, uint32_t page_count, void *dst, uint32_t offset, size_t len);
 static int write_page (MDB *db, uint32_t page);
+static int insert_begin (MDB *db, uint8_t table, uint32_t rowid, uint32_t valuelen);
+static int fsm_save (MDB *db);
+static int fsm_load (MDB *db);
+static int fsm_rebuild (MDB *db);
+static int fsm_require (MDB *db);
+static int find_empty_row (MDB *db, uint32_t *page_start, uint32_t requested_page_count, uint32_t near);
+static int index_load (MDB *db);
+static int index_save (MDB *db, uint8_t state);
+static int index_rebuild (MDB *db);
+
+
+/* Handle pages in the caller's buffer, if they don't fit into the MDB struct. */
+static int set_page_buffer (MDB *db, MDB_OPTIONS const *options)
+{
+	if (db->page_size <= MDB_MAX_PAGE_SIZE)
+		return 0;
+
+	if (!options || !options->page_buffer || options->page_buffer_size < MDB_PAGE_BUFFER_SIZE (db->page_size))
+		return MDBE_NO_PAGE_BUFFER;
+
+	memset (options->page_buffer, 0, options->page_buffer_size);
+	db->tmp = options->page_buffer;
+	db->tmp_size = options->page_buffer_size;
+
+	return 0;
+}
+
+
+/* Expand a wrapping key.  Plaintext databases still have their keys encrypted. */
+static void expand_wrapping_key (MDB_CIPHER_KEYS *keys, int suite, uint8_t const wrapping_key[static MDB_WRAPPING_KEY_SIZE])
+{
+	mdbc_expand_keys (keys, (suite == MDBC_PLAINTEXT) ? MDBC_THREEFISH : suite, wrapping_key);
+}
+
+
+/* Encrypt the derived keys under `wrapping_key`, then MAC them. */
+static void wrap_key (uint8_t wrapped[static MDB_WRAPPED_KEY_SIZE], int suite, uint8_t const wrapping_key[static MDB_WRAPPING_KEY_SIZE], uint8_t const derived_keys[static 128])
+{
+	MDB_CIPHER_KEYS keys;
+
+	expand_wrapping_key (&keys, suite, wrapping_key);
+	mdbc_encrypt (wrapped, &keys, derived_keys, 128, 0);
+	mdbc_mac (wrapped + 128, &keys, wrapped, 128);
+	secure_memset (&keys, 0, sizeof (keys));
+}
+
+
+/* Check the MAC of a key from wrap_key, then decrypt it. */
+static int unwrap_key (uint8_t derived_keys[static 128], int suite, uint8_t const wrapping_key[static MDB_WRAPPING_KEY_SIZE], uint8_t const wrapped[static MDB_WRAPPED_KEY_SIZE])
+{
+	MDB_CIPHER_KEYS keys;
+	uint8_t mac[32];
+	int err = 0;
+
+	expand_wrapping_key (&keys, suite, wrapping_key);
+	mdbc_mac (mac, &keys, wrapped, 128);
+
+	if (secure_memcmp (mac, wrapped + 128, 32))
+		err = MDBE_BAD_PASSWORD;
+	else
+		mdbc_decrypt (derived_keys, &keys, wrapped, 128, 0);
 
+	secure_memset (&keys, 0, sizeof (keys));
+
+	return err;
+}
 
 
 int mdb_create (MDB *db, char const *path, uint8_t const *password, size_t password_len, uint64_t iteration_count)
+{
+	return mdb_create_ex (db, path, password, password_len, iteration_count, MDB_DEFAULT_PAGE_SIZE, NULL);
+}
+
+
+int mdb_create_ex (MDB *db, char const *path, uint8_t const *password, size_t password_len, uint64_t iteration_count, uint32_t page_size, MDB_OPTIONS const *options)
 {
 	int err;
-	const uint32_t page_size = MDB_DEFAULT_PAGE_SIZE;
 	uint8_t header_hash[32];
 	uint8_t derived_keys[128];
-	const uint32_t header_len = roundup_uint32 (sizeof (RAW_HEADER), page_size);
-	const uint32_t params_len = roundup_uint32 (sizeof (RAW_PARAMS), page_size);
+	MDB_CIPHER_KEYS derived_cipher_keys;
+	char const *ciphersuite_name = (options && options->ciphersuite) ? options->ciphersuite : MDBC_CIPHERSUITE;
+	uint8_t ciphersuite[32] = {0};
+	int suite;
 
-	if (strlen (MDBC_CIPHERSUITE) > 32 || strlen (MDBC_KDF) > 32)
+	if (strlen (MDBC_KDF) > 32)
 		mdba_fatal_error ();
 
 	if (db->fd)
 		return MDBE_ALREADY_OPEN;
 
+	if (page_size < 256 || page_size > MDB_MAX_LARGE_PAGE_SIZE || (page_size & (page_size - 1)))
+		return MDBE_UNSUPPORTED_PAGE_SIZE;
+
+	if (strlen (ciphersuite_name) > sizeof (ciphersuite))
+		return MDBE_UNSUPPORTED_CIPHER;
+
+	memmove (ciphersuite, ciphersuite_name, strlen (ciphersuite_name));
+
+	if ((suite = mdbc_find_ciphersuite (ciphersuite)) < 0)
+		return MDBE_UNSUPPORTED_CIPHER;
+
+	const uint32_t header_len = roundup_uint32 (sizeof (RAW_HEADER), page_size);
+	const uint32_t params_len = roundup_uint32 (sizeof (RAW_PARAMS), page_size);
+
 	memset (db, 0, sizeof (MDB));
+	db->tmp = db->tmp_buffer;
+	db->tmp_size = sizeof (db->tmp_buffer);
+	db->page_size = page_size;
+
+	if ((err = set_page_buffer (db, options)))
+	{
+		mdb_close (db);
+		return err;
+	}
 
 	/* Open database file */
 	if ((db->fd = mdba_open (path, O_RDWR | O_CREAT | O_EXCL)) == -1)
@@ -85,23 +237,25 @@ int mdb_create (MDB *db, char const *path, uint8_t const *password, size_t passw
 		return MDBE_OPEN;
 	}
 
-	db->page_size = page_size;
+	db->version = VERSION_1_1;
 	db->page_offset = header_len + 2 * params_len;
+	db->first_page = FSM_PAGE + META_PAGES;
 	db->real_page_size = (db->page_size - 32) / MDBC_ENCRYPTION_BLOCK_SIZE;
 	db->real_page_size *= MDBC_ENCRYPTION_BLOCK_SIZE;
 
 	/* Generate Encryption Keys */
 	mdba_read_urandom (db->keys, 128);
+	mdbc_expand_keys (&db->cipher_keys, suite, db->keys);
 
 	/* Database Header */
 	RAW_HEADER *header = (RAW_HEADER *)(db->tmp);
 
 	memset (header, 0, sizeof (RAW_HEADER));
 	memmove (header->magic, "MEAGERDB", 8);                                       /* Magic */
-	pack_uint16_little (header->version, 0x0100);                                 /* Version */
+	pack_uint16_little (header->version, db->version);                            /* Version */
 	pack_uint32_little (header->page_size, db->page_size);                        /* Page Size */
 	mdba_read_urandom (header->db_id, 32);                                        /* Unique ID */
-	memmove (header->ciphersuite, MDBC_CIPHERSUITE, strlen (MDBC_CIPHERSUITE));   /* Ciphersuite */
+	memmove (header->ciphersuite, ciphersuite, sizeof (ciphersuite));              /* Ciphersuite */
 	mdbc_hash (header_hash, header, sizeof (RAW_HEADER)-32);
 
 	ERROR_AND_CLOSE_IF (mdba_write (db->fd, header, sizeof (RAW_HEADER)-32), MDBE_IO);
@@ -127,10 +281,13 @@ int mdb_create (MDB *db, char const *path, uint8_t const *password, size_t passw
 	mdbc_kdf (derived_keys, password, password_len, params->salt, sizeof (params->salt), params->kdf_params, sizeof (derived_keys));
 
 	/* Encrypt Real Keys */
-	mdbc_encrypt (params->keys, derived_keys, params->keys, 128, header_len + offsetof (RAW_PARAMS, keys));
+	mdbc_expand_keys (&derived_cipher_keys, suite, derived_keys);
+	secure_memset (derived_keys, 0, sizeof (derived_keys));
+	mdbc_encrypt (params->keys, &derived_cipher_keys, params->keys, 128, header_len + offsetof (RAW_PARAMS, keys));
 
 	/* MAC and HASH */
-	mdbc_mac (params->mac, derived_keys, db->tmp, 32 + sizeof (RAW_PARAMS) - 64);
+	mdbc_mac (params->mac, &derived_cipher_keys, db->tmp, 32 + sizeof (RAW_PARAMS) - 64);
+	secure_memset (&derived_cipher_keys, 0, sizeof (derived_cipher_keys));
 	mdbc_hash (params->hash, params, sizeof (RAW_PARAMS) - 32);
 
 	ERROR_AND_CLOSE_IF (mdba_write (db->fd, params, sizeof (RAW_PARAMS)), MDBE_IO);
@@ -138,7 +295,7 @@ int mdb_create (MDB *db, char const *path, uint8_t const *password, size_t passw
 	/* Pad previous Encryption Parameters block, and write a blank second EP block. */
 	/* This is safe, because tmp is at least big enough to fit a page, and padding will never
 	 * be more than one page.  EP block will never be larger than tmp either. */
-	memset (db->tmp, 0, sizeof (db->tmp));
+	memset (db->tmp, 0, db->tmp_size);
 	ERROR_AND_CLOSE_IF (mdba_write (db->fd, db->tmp, params_len - sizeof (RAW_PARAMS)), MDBE_IO);
 	ERROR_AND_CLOSE_IF (mdba_write (db->fd, db->tmp, sizeof (RAW_PARAMS)), MDBE_IO);
 	ERROR_AND_CLOSE_IF (mdba_write (db->fd, db->tmp, params_len - sizeof (RAW_PARAMS)), MDBE_IO);
@@ -148,9 +305,25 @@ int mdb_create (MDB *db, char const *path, uint8_t const *password, size_t passw
 	ERROR_AND_CLOSE_IF (mdba_write (db->fd, db->tmp, db->page_size), MDBE_IO);
 	ERROR_AND_CLOSE_IF (mdba_write (db->fd, db->tmp, db->page_size), MDBE_IO);
 
+	/* Write Metadata (blank, except for an empty free space map) */
+	for (uint32_t i = 0; i < META_PAGES; ++i)
+		ERROR_AND_CLOSE_IF (mdba_write (db->fd, db->tmp, db->page_size), MDBE_IO);
+
+	db->fsm_end = db->first_page;
+	db->fsm_valid = true;
+	ERROR_AND_CLOSE_IF (err = fsm_save (db), err);
+
+	for (uint32_t i = 0; i < 256 / ROWID_PAGE_TABLES; ++i)
+	{
+		memset (db->tmp, 0, db->page_size);
+		ERROR_AND_CLOSE_IF (err = write_page (db, ROWID_PAGE + i), err);
+	}
+
+	ERROR_AND_CLOSE_IF (err = index_save (db, INDEX_CLEAN), err);
+
 	/* Write row terminator */
 	memset (db->tmp, 0, db->page_size);
-	ERROR_AND_CLOSE_IF (err = write_page (db, 2), err);
+	ERROR_AND_CLOSE_IF (err = write_page (db, db->first_page), err);
 
 	/* Sync and close */
 	ERROR_AND_CLOSE_IF (mdba_fsync (db->fd), MDBE_IO);
@@ -161,18 +334,43 @@ int mdb_create (MDB *db, char const *path, uint8_t const *password, size_t passw
 
 
 int mdb_open (MDB *db, char const *path, uint8_t const *password, size_t password_len)
+{
+	return mdb_open_ex (db, path, password, password_len, NULL);
+}
+
+
+int mdb_open_ex (MDB *db, char const *path, uint8_t const *password, size_t password_len, MDB_OPTIONS const *options)
 {
 	int err;
 	uint8_t calculated_mac[32];
 	uint8_t derived_keys[128];
+	MDB_CIPHER_KEYS derived_cipher_keys;
+	int suite;
 
 	/* Open database file */
 	if (db->fd)
 		return MDBE_ALREADY_OPEN;
 	
 	memset (db, 0, sizeof (MDB));
+	db->tmp = db->tmp_buffer;
+	db->tmp_size = sizeof (db->tmp_buffer);
+
+	if (options && options->sync_mode != MDB_SYNC_FULL && options->sync_mode != MDB_SYNC_JOURNAL)
+		return MDBE_BAD_ARGUMENT;
+
+	if (options)
+	{
+		db->sync_mode = options->sync_mode;
+		db->read_only = options->read_only;
+	}
 
-	if ((db->fd = mdba_open (path, O_RDWR)) == -1)
+	if (options && options->cache)
+	{
+		memset (options->cache, 0, options->cache_size);
+		db->cache = options->cache;
+	}
+
+	if ((db->fd = mdba_open (path, db->read_only ? O_RDONLY : O_RDWR)) == -1)
 	{
 		db->fd = 0;
 		return MDBE_OPEN;
@@ -185,9 +383,10 @@ int mdb_open (MDB *db, char const *path, uint8_t const *password, size_t passwor
 
 	/* Check and parse header */
 	ERROR_AND_CLOSE_IF (memcmp (header->magic, "MEAGERDB", 8), MDBE_NOT_MDB);
-	ERROR_AND_CLOSE_IF (unpack_uint16_little (header->version) != 0x0100, MDBE_BAD_VERSION);
+	db->version = unpack_uint16_little (header->version);
+	ERROR_AND_CLOSE_IF (db->version != VERSION_1_0 && db->version != VERSION_1_1, MDBE_BAD_VERSION);
 	db->page_size = unpack_uint32_little (header->page_size);
-	ERROR_AND_CLOSE_IF (memcmp (header->ciphersuite, MDBC_CIPHERSUITE, strlen (MDBC_CIPHERSUITE)), MDBE_UNSUPPORTED_CIPHER);
+	ERROR_AND_CLOSE_IF ((suite = mdbc_find_ciphersuite (header->ciphersuite)) < 0, MDBE_UNSUPPORTED_CIPHER);
 
 	/* Integrity check */
 	mdbc_hash (calculated_mac, header, sizeof (RAW_HEADER) - 32);
@@ -196,7 +395,9 @@ int mdb_open (MDB *db, char const *path, uint8_t const *password, size_t passwor
 	/* Check if we can handle this DB */
 	ERROR_AND_CLOSE_IF (db->page_size < 256, MDBE_BAD_PAGE_SIZE);
 	ERROR_AND_CLOSE_IF ((db->page_size - 32) < MDBC_ENCRYPTION_BLOCK_SIZE, MDBE_BAD_PAGE_SIZE);
-	ERROR_AND_CLOSE_IF (db->page_size > MDB_MAX_PAGE_SIZE, MDBE_UNSUPPORTED_PAGE_SIZE);
+	ERROR_AND_CLOSE_IF (db->page_size > MDB_MAX_LARGE_PAGE_SIZE, MDBE_UNSUPPORTED_PAGE_SIZE);
+	ERROR_AND_CLOSE_IF (db->page_size & (db->page_size - 1), MDBE_UNSUPPORTED_PAGE_SIZE);
+	ERROR_AND_CLOSE_IF (err = set_page_buffer (db, options), err);
 
 	db->real_page_size = (db->page_size - 32) / MDBC_ENCRYPTION_BLOCK_SIZE;
 	db->real_page_size *= MDBC_ENCRYPTION_BLOCK_SIZE;
@@ -225,637 +426,3334 @@ int mdb_open (MDB *db, char const *path, uint8_t const *password, size_t passwor
 	/* Check encryption parameters */
 	ERROR_AND_CLOSE_IF (memcmp (params->kdf, MDBC_KDF, strlen (MDBC_KDF)), MDBE_BAD_KEY_DERIVE);
 
-	/* Derive keys */
-	mdbc_kdf (derived_keys, password, password_len, params->salt, sizeof (params->salt), params->kdf_params, sizeof (derived_keys));
+	/* Derive keys, unless the caller kept them from an earlier open */
+	ERROR_AND_CLOSE_IF (options && (options->wrapped_key || options->wrapped_key_out) && !options->wrapping_key, MDBE_BAD_ARGUMENT);
+
+	if (options && options->wrapped_key)
+	{
+		ERROR_AND_CLOSE_IF (err = unwrap_key (derived_keys, suite, options->wrapping_key, options->wrapped_key), err);
+	}
+	else
+		mdbc_kdf (derived_keys, password, password_len, params->salt, sizeof (params->salt), params->kdf_params, sizeof (derived_keys));
 
 	/* Authenticate header */
-	mdbc_mac (calculated_mac, derived_keys, db->tmp, 32 + sizeof (RAW_PARAMS) - 64);
+	mdbc_expand_keys (&derived_cipher_keys, suite, derived_keys);
+	mdbc_mac (calculated_mac, &derived_cipher_keys, db->tmp, 32 + sizeof (RAW_PARAMS) - 64);
 
-	ERROR_AND_CLOSE_IF (secure_memcmp (params->mac, calculated_mac, 32), MDBE_BAD_PASSWORD);
+	if (secure_memcmp (params->mac, calculated_mac, 32))
+	{
+		secure_memset (derived_keys, 0, sizeof (derived_keys));
+		secure_memset (&derived_cipher_keys, 0, sizeof (derived_cipher_keys));
+		CLOSE_AND_ERROR (MDBE_BAD_PASSWORD);
+	}
+
+	if (options && options->wrapped_key_out)
+		wrap_key (options->wrapped_key_out, suite, options->wrapping_key, derived_keys);
+
+	secure_memset (derived_keys, 0, sizeof (derived_keys));
 
 	/* Decrypt real keys */
-	mdbc_decrypt (db->keys, derived_keys, params->keys, 128, header_len + offsetof (RAW_PARAMS, keys));
+	mdbc_decrypt (db->keys, &derived_cipher_keys, params->keys, 128, header_len + offsetof (RAW_PARAMS, keys));
+	secure_memset (&derived_cipher_keys, 0, sizeof (derived_cipher_keys));
+	mdbc_expand_keys (&db->cipher_keys, suite, db->keys);
 
 	/* Nuke key material from tmp */
-	secure_memset (db->tmp, 0, sizeof (db->tmp));
+	secure_memset (db->tmp, 0, db->tmp_size);
 
 	/* Additional DB parameters */
 	db->page_offset = header_len + 2 * params_len;
+	db->first_page = FSM_PAGE + ((db->version == VERSION_1_0) ? 0 : META_PAGES);
+
+	if (db->cache)
+	{
+		size_t cache_count = options->cache_size / (CACHE_ENTRY_HEADER + 2 * CACHE_BUCKET + db->real_page_size);
+
+		db->cache_count = (uint32_t)MIN (cache_count, 0x7fffffff);
+		db->cache_buckets = 2 * db->cache_count;
+	}
+
+	if (options && options->batch_buffer)
+	{
+		size_t batch_slots = options->batch_buffer_size / MDB_PAGE_BUFFER_SIZE (db->page_size);
+
+		memset (options->batch_buffer, 0, options->batch_buffer_size);
+		db->batch = options->batch_buffer;
+		db->batch_slots = (uint32_t)MIN (batch_slots, MDB_BATCH_PAGES);
+	}
+
+	/* Load the free space map before journal recovery, which keeps it up to date */
+	ERROR_AND_CLOSE_IF ((err = fsm_load (db)) && err != MDBE_CORRUPT, err);
+
+	/* A read-only database is left as it is found */
+	if (db->read_only)
+	{
+		ERROR_AND_CLOSE_IF ((err = index_load (db)) && err != MDBE_CORRUPT, err);
+		return 0;
+	}
 
 	/* Cleanup Journal */
 	ERROR_AND_CLOSE_IF (err = cleanup_journal (db), err);
 
+	/* Version 1.0 databases have no free space map, and a damaged one can be rebuilt.  Either way
+	 * that's left to the first write that needs it (see fsm_require), so opening doesn't read every
+	 * row, or fail because one of them is damaged. */
+
+	/* The index is only trusted if the database was closed properly.  If damaged rows stop it
+	 * from being rebuilt, the database is used without one, and stays marked dirty on disk. */
+	ERROR_AND_CLOSE_IF ((err = index_load (db)) && err != MDBE_CORRUPT, err);
+
+	if (err == MDBE_CORRUPT)
+		ERROR_AND_CLOSE_IF ((err = index_rebuild (db)) == MDBE_IO, err);
+
 	return 0;
 }
 
 
-/* Read specified page into db->tmp and set db->tmp_page accordingly. */
-static int read_page (MDB *db, uint32_t page)
+static uint8_t *cache_entry (MDB const *db, uint32_t idx)
 {
-	if (!db->fd)
-		return MDBE_NOT_OPEN;
-
-	uint8_t calculated_mac[32];
-	uint64_t pos = db->page_offset + (uint64_t)page * (uint64_t)(db->page_size);
-
-	if (db->tmp_page == page && db->tmp_page != 0)
-		return 0;
+	return db->cache + (size_t)idx * (CACHE_ENTRY_HEADER + db->real_page_size);
+}
 
-	db->tmp_page = 0;
 
-	if (mdba_lseek (db->fd, pos, SEEK_SET))
-		return MDBE_IO;
-	
-	if (mdba_read (db->fd, db->tmp, db->real_page_size + 32))
-		return MDBE_IO;
+static uint8_t *cache_bucket (MDB const *db, uint32_t bucket)
+{
+	return cache_entry (db, db->cache_count) + (size_t)bucket * CACHE_BUCKET;
+}
 
-	/* Move MAC so there's room for tweak */
-	memmove (db->tmp + db->real_page_size + 8, db->tmp + db->real_page_size, 32);
 
-	/* Concat tweak for MAC */
-	pack_uint64_little (db->tmp + db->real_page_size, pos);
+/* The bucket where a lookup of `page` starts.  Pages are mostly sequential, so they are spread
+ * with a multiplicative hash. */
+static uint32_t cache_home (MDB const *db, uint32_t page)
+{
+	return (uint32_t)(((uint64_t)page * 2654435761u) % db->cache_buckets);
+}
 
-	/* Authenticate */
-	mdbc_mac (calculated_mac, db->keys, db->tmp, db->real_page_size + 8);
 
-	if (secure_memcmp (calculated_mac, db->tmp + db->real_page_size + 8, 32))
-		return MDBE_CORRUPT;
+/* Returns the bucket that holds the specified page, or else the empty bucket where it would go.
+ * At most half of the buckets are in use, so there always is one. */
+static uint32_t cache_probe (MDB const *db, uint32_t page)
+{
+	uint32_t bucket = cache_home (db, page);
 
-	/* Decrypt */
-	mdbc_decrypt (db->tmp, db->keys, db->tmp, db->real_page_size, pos);
+	while (1)
+	{
+		uint32_t idx = unpack_uint32_little (cache_bucket (db, bucket));
 
-	db->tmp_page = page;
+		if (idx == 0 || unpack_uint32_little (cache_entry (db, idx - 1)) == page)
+			return bucket;
 
-	return 0;
+		bucket = (bucket + 1) % db->cache_buckets;
+	}
 }
 
 
-/* Write db->tmp to the specified page */
-static int write_page (MDB *db, uint32_t page)
+/* Remove the specified page from the buckets, shifting the entries after it back so that no
+ * lookup stops early at the hole. */
+static void cache_unlink (MDB *db, uint32_t page)
 {
-	if (!db->fd)
-		return MDBE_NOT_OPEN;
-
-	uint64_t pos = db->page_offset + (uint64_t)page * (uint64_t)(db->page_size);
+	uint32_t hole = cache_probe (db, page);
+	uint32_t bucket = hole;
 
-	db->tmp_page = 0;
+	if (unpack_uint32_little (cache_bucket (db, hole)) == 0)
+		return;
 
-	/* Encrypt */
-	mdbc_encrypt (db->tmp, db->keys, db->tmp, db->real_page_size, pos);
-	
-	/* MAC */
-	pack_uint64_little (db->tmp + db->real_page_size, pos);
-	mdbc_mac (db->tmp + db->real_page_size + 8, db->keys, db->tmp, db->real_page_size + 8);
-	memmove (db->tmp + db->real_page_size, db->tmp + db->real_page_size + 8, 32);
+	while (1)
+	{
+		bucket = (bucket + 1) % db->cache_buckets;
 
-	/* Write */
-	if (mdba_lseek (db->fd, pos, SEEK_SET))
-		return MDBE_IO;
+		uint32_t idx = unpack_uint32_little (cache_bucket (db, bucket));
 
-	if (mdba_write (db->fd, db->tmp, db->real_page_size + 32))
-		return MDBE_IO;
+		if (idx == 0)
+			break;
 
-	/* Padding, if necessary.
- 	 * Re-use tmp; blanking tmp would just cost extra cycles, and there is no risk. */
-	if (mdba_write (db->fd, db->tmp, db->page_size - db->real_page_size - 32))
-		return MDBE_IO;
+		/* An entry can fill the hole unless its lookup starts after the hole */
+		uint32_t home = cache_home (db, unpack_uint32_little (cache_entry (db, idx - 1)));
+		bool after_hole = (hole <= bucket) ? (home > hole && home <= bucket) : (home > hole || home <= bucket);
 
-	if (mdba_fsync (db->fd))
-		return MDBE_IO;
+		if (!after_hole)
+		{
+			pack_uint32_little (cache_bucket (db, hole), idx);
+			hole = bucket;
+		}
+	}
 
-	return 0;
+	pack_uint32_little (cache_bucket (db, hole), 0);
 }
 
 
-static int cleanup_journal (MDB *db)
+/* Returns the cache entry of the specified page, or NULL if it isn't cached. */
+static uint8_t *cache_find (MDB const *db, uint32_t page)
 {
-	int err;
-	uint32_t page_start, page_count;
+	/* Page 0 marks unused entries, just like tmp_page. */
+	if (db->cache_count == 0 || page == 0)
+		return NULL;
 
-	/* Check Journal 1 */
-	err = read_page (db, 1);
-	page_start = unpack_uint32_little (db->tmp);
-	page_count = unpack_uint32_little (db->tmp + 4);
+	uint32_t idx = unpack_uint32_little (cache_bucket (db, cache_probe (db, page)));
 
-	if (err == 0 && page_count != 0)
-	{
-		/* Must point to a row */
-		if (page_start < FIRST_PAGE)
-			return -1;
+	return idx ? cache_entry (db, idx - 1) : NULL;
+}
 
-		/* Journal 1 is valid, execute it */
-		/* Nuke Journal 0 */
-		if ((err = set_journal (db, JOURNAL0, 0, 0)))
-			return err;
 
-		/* Nuke target */
-		for (uint32_t count = page_count; count; --count)
-		{
-			/* Empty row */
-			memset (db->tmp, 0, db->page_size);
-			pack_uint32_little (db->tmp, 1);
+/* Returns the cached plaintext of the specified page, or NULL if it isn't cached. */
+static uint8_t *cache_lookup (MDB *db, uint32_t page)
+{
+	uint8_t *entry = cache_find (db, page);
 
-			if ((err = write_page (db, page_start + count - 1)))
-				return err;
-		}
+	if (!entry)
+		return NULL;
 
-		/* Nuke Journal 1 */
-		if ((err = set_journal (db, JOURNAL1, 0, 0)))
-			return err;
+	entry[4] = 1;
 
-		return 0;
-	}
-	else if (err != 0 && err != MDBE_CORRUPT)
-		return err;
+	return entry + CACHE_ENTRY_HEADER;
+}
 
-	/* Check Journal 0 */
-	err = read_page (db, 0);
-	page_start = unpack_uint32_little (db->tmp);
-	page_count = unpack_uint32_little (db->tmp + 4);
 
-	if (err == 0 && page_count != 0)
+/* Store a page's plaintext in the cache, evicting an entry if necessary (CLOCK). */
+static void cache_store (MDB *db, uint32_t page, uint8_t const *data)
+{
+	if (db->cache_count == 0 || page == 0)
+		return;
+
+	uint32_t bucket = cache_probe (db, page);
+	uint32_t idx = unpack_uint32_little (cache_bucket (db, bucket));
+	uint8_t *entry;
+
+	if (idx)
 	{
-		/* Must point to a row */
-		if (page_start < FIRST_PAGE)
-			return -1;
+		entry = cache_entry (db, idx - 1);
+		entry[4] = 1;
+		memmove (entry + CACHE_ENTRY_HEADER, data, db->real_page_size);
+		return;
+	}
 
-		/* Journal 0 is valid, execute it */
-		/* Nuke target */
-		for (uint32_t count = page_count; count; --count)
-		{
-			/* Empty row */
-			memset (db->tmp, 0, db->page_size);
-			pack_uint32_little (db->tmp, 1);
+	while (1)
+	{
+		idx = db->cache_hand;
+		entry = cache_entry (db, idx);
+		db->cache_hand = (db->cache_hand + 1) % db->cache_count;
 
-			if ((err = write_page (db, page_start + count - 1)))
-				return err;
-		}
+		if (!entry[4])
+			break;
 
-		/* Nuke Journal 0 */
-		if ((err = set_journal (db, JOURNAL0, 0, 0)))
-			return err;
+		entry[4] = 0;
+	}
 
-		return 0;
+	/* The evicted page's bucket goes, which may move the others */
+	if (unpack_uint32_little (entry) != 0)
+	{
+		cache_unlink (db, unpack_uint32_little (entry));
+		bucket = cache_probe (db, page);
 	}
-	else if (err != 0 && err != MDBE_CORRUPT)
-		return err;
 
-	return 0;
+	pack_uint32_little (cache_bucket (db, bucket), idx + 1);
+	pack_uint32_little (entry, page);
+	entry[4] = 1;
+	memmove (entry + CACHE_ENTRY_HEADER, data, db->real_page_size);
 }
 
 
-void mdb_close (MDB *db)
+static void cache_invalidate (MDB *db, uint32_t page)
 {
-	if (db->fd)
-		mdba_close (db->fd);
+	uint8_t *entry = cache_find (db, page);
 
-	secure_memset (db, 0, sizeof (MDB));
+	if (entry)
+	{
+		cache_unlink (db, page);
+		secure_memset (entry, 0, CACHE_ENTRY_HEADER + db->real_page_size);
+	}
 }
 
 
-static int set_journal (MDB *db, int journal, uint32_t page_start, uint32_t page_count)
+static uint64_t page_pos (MDB const *db, uint32_t page)
 {
-	int err;
+	return db->page_offset + (uint64_t)page * (uint64_t)(db->page_size);
+}
 
-	if (!db->fd)
-		return MDBE_NOT_OPEN;
 
-	if (journal != 0 && journal != 1)
-		return -1;
+/*
+ * Authenticate and decrypt, in place, `count` (up to MDB_BATCH_PAGES) pages read into consecutive
+ * MDB_PAGE_BUFFER_SIZE slots of `buf`, from the pages in `pages`.  Their MACs are computed together.
+ * Returns the pages that failed authentication, as a bit mask.  Only reads from `db`, so it may run
+ * on several threads at once.
+ */
+static uint32_t open_pages (MDB const *db, uint8_t *buf, uint32_t const *pages, uint32_t count)
+{
+	uint8_t calculated_macs[MDB_BATCH_PAGES][32];
+	void *macs[MDB_BATCH_PAGES] = {0};
+	void const *data[MDB_BATCH_PAGES] = {0};
+	uint32_t corrupt = 0;
 
-	memset (db->tmp, 0, db->page_size);
-	pack_uint32_little (db->tmp, page_start);
-	pack_uint32_little (db->tmp + 4, page_count);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint8_t *page = buf + i * MDB_PAGE_BUFFER_SIZE (db->page_size);
 
-	if ((err = write_page (db, journal)))
-		return err;
+		/* Move MAC so there's room for tweak */
+		memmove (page + db->real_page_size + 8, page + db->real_page_size, 32);
 
-	return 0;
+		/* Concat tweak for MAC */
+		pack_uint64_little (page + db->real_page_size, page_pos (db, pages[i]));
+
+		macs[i] = calculated_macs[i];
+		data[i] = page;
+	}
+
+	/* Authenticate */
+	mdbc_page_mac_multi (macs, &db->cipher_keys, data, db->real_page_size + 8, count);
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint8_t *page = buf + i * MDB_PAGE_BUFFER_SIZE (db->page_size);
+
+		if (secure_memcmp (calculated_macs[i], page + db->real_page_size + 8, 32))
+			corrupt |= 1u << i;
+		else
+			mdbc_decrypt (page, &db->cipher_keys, page, db->real_page_size, page_pos (db, pages[i]));
+	}
+
+	return corrupt;
 }
 
 
-/* Find an empty row of the specified size.
- * Otherwise, creates a new empty row.
- */
-static int find_empty_row (MDB *db, uint32_t *page_start, uint32_t requested_page_count)
+/* Returns the plaintext of the specified page in the batch buffer, or NULL if it isn't there. */
+static uint8_t *batch_find (MDB const *db, uint32_t page)
 {
-	int err;
-	uint32_t potential_start = 2;
-	uint32_t potential_count = 0;
-	uint32_t page_count;
-	uint32_t row_id;
+	/* Page 0 marks pages that failed authentication */
+	if (page == 0)
+		return NULL;
 
-	if (!db->fd)
-		return MDBE_NOT_OPEN;
+	for (uint32_t i = 0; i < db->batch_count; ++i)
+	{
+		if (db->batch_pages[i] == page)
+			return db->batch + i * MDB_PAGE_BUFFER_SIZE (db->page_size);
+	}
 
-	if (requested_page_count == 0 || requested_page_count == 0xffffffff)
-		return -1;
+	return NULL;
+}
 
-	while (1)
+
+static void batch_invalidate (MDB *db, uint32_t page)
+{
+	for (uint32_t i = 0; i < db->batch_count; ++i)
 	{
-		if ((err = read_page (db, potential_start + potential_count)))
+		if (db->batch_pages[i] == page)
+			db->batch_pages[i] = 0;
+	}
+}
+
+
+/* Read specified page into db->tmp and set db->tmp_page accordingly. */
+static int read_page (MDB *db, uint32_t page)
+{
+	if (!db->fd)
+		return MDBE_NOT_OPEN;
+
+	uint8_t const *cached, *mapped;
+	uint64_t pos = page_pos (db, page);
+
+	if (db->tmp_page == page && db->tmp_page != 0)
+		return 0;
+
+	db->tmp_page = 0;
+
+	if ((cached = cache_lookup (db, page)))
+	{
+		memmove (db->tmp, cached, db->real_page_size);
+		db->tmp_page = page;
+		return 0;
+	}
+
+	if ((cached = batch_find (db, page)))
+	{
+		memmove (db->tmp, cached, db->real_page_size);
+		db->tmp_page = page;
+		cache_store (db, page, db->tmp);
+		return 0;
+	}
+
+	if (mdba_map && (mapped = mdba_map (db->fd, pos, db->real_page_size + 32)))
+	{
+		/* Copied once, so the MAC and the decryption both see the same bytes, even if the
+		 * file is changed underneath the mapping */
+		memmove (db->tmp, mapped, db->real_page_size + 32);
+	}
+	else if (mdba_pread)
+	{
+		if (mdba_pread (db->fd, db->tmp, db->real_page_size + 32, pos))
+			return MDBE_IO;
+	}
+	else
+	{
+		if (mdba_lseek (db->fd, pos, SEEK_SET))
+			return MDBE_IO;
+
+		if (mdba_read (db->fd, db->tmp, db->real_page_size + 32))
+			return MDBE_IO;
+	}
+
+	if (open_pages (db, db->tmp, &page, 1))
+		return MDBE_CORRUPT;
+
+	db->tmp_page = page;
+	cache_store (db, page, db->tmp);
+
+	return 0;
+}
+
+
+/*
+ * Read `count` (up to MDB_BATCH_PAGES) pages into consecutive MDB_PAGE_BUFFER_SIZE slots of `buf`,
+ * without db->tmp or the cache, and authenticate them together.  Stops at the first page that
+ * can't be read, setting `*loaded` to the number of pages that were; pages that fail
+ * authentication are set in the bit mask `*corrupt`.  With mdba_pread, it may run on several
+ * threads at once, as long as nothing writes to the database.
+ */
+static int load_pages (MDB const *db, uint32_t const *pages, uint32_t count, uint8_t *buf, uint32_t *loaded, uint32_t *corrupt)
+{
+	int err = 0;
+	uint32_t i;
+
+	for (i = 0; i < count && !err; ++i)
+	{
+		uint8_t *slot = buf + i * MDB_PAGE_BUFFER_SIZE (db->page_size);
+
+		if (mdba_pread)
+			err = mdba_pread (db->fd, slot, db->real_page_size + 32, page_pos (db, pages[i]));
+		else
+			err = mdba_lseek (db->fd, page_pos (db, pages[i]), SEEK_SET) || mdba_read (db->fd, slot, db->real_page_size + 32);
+	}
+
+	*loaded = err ? i - 1 : i;
+	*corrupt = open_pages (db, buf, pages, *loaded);
+
+	return err ? MDBE_IO : 0;
+}
+
+
+/* Read `page` into `buf` (MDB_PAGE_BUFFER_SIZE bytes), as load_pages. */
+static int load_page (MDB const *db, uint32_t page, uint8_t *buf)
+{
+	uint32_t loaded, corrupt;
+	int err;
+
+	if ((err = load_pages (db, &page, 1, buf, &loaded, &corrupt)))
+		return err;
+
+	return corrupt ? MDBE_CORRUPT : 0;
+}
+
+
+/*
+ * Read `pages` into the batch buffer, authenticating them together, when the first of them is
+ * about to be read with read_page and the others soon after.  Pages that are already at hand are
+ * skipped.  Pages that can't be read or authenticated are just left out; read_page then tries them
+ * again, and reports it.
+ */
+static void read_batch (MDB *db, uint32_t const *pages, uint32_t count)
+{
+	uint32_t batch[MDB_BATCH_PAGES];
+	uint32_t n = 0, loaded, corrupt;
+
+	if (db->batch_slots < 2 || count < 2 || batch_find (db, pages[0]) || pages[0] == db->tmp_page || cache_find (db, pages[0]))
+		return;
+
+	for (uint32_t i = 0; i < count && n < db->batch_slots; ++i)
+	{
+		if (pages[i] != 0 && pages[i] != db->tmp_page && !cache_find (db, pages[i]))
+			batch[n++] = pages[i];
+	}
+
+	if (n < 2)
+		return;
+
+	db->batch_count = 0;
+	load_pages (db, batch, n, db->batch, &loaded, &corrupt);
+
+	for (uint32_t i = 0; i < loaded; ++i)
+		db->batch_pages[i] = (corrupt & (1u << i)) ? 0 : batch[i];
+
+	db->batch_count = loaded;
+}
+
+
+/* read_batch of the `count` pages from `page_start` on */
+static void read_batch_span (MDB *db, uint32_t page_start, uint32_t count)
+{
+	uint32_t pages[MDB_BATCH_PAGES];
+
+	count = MIN (count, MDB_BATCH_PAGES);
+
+	for (uint32_t i = 0; i < count; ++i)
+		pages[i] = page_start + i;
+
+	read_batch (db, pages, count);
+}
+
+
+/* Let the application layer start reading a page that will be needed soon. */
+static void prefetch_page (MDB *db, uint32_t page)
+{
+	if (!mdba_prefetch || page == db->tmp_page || cache_find (db, page))
+		return;
+
+	mdba_prefetch (db->fd, page_pos (db, page), db->real_page_size + 32);
+}
+
+
+/*
+ * Call before reading the header of the row at `page`, while walking the rows in order.
+ * The pages after it are hinted to the application layer, and the row headers among them are
+ * read into the batch buffer.  The window doubles (up to READ_AHEAD_PAGES) for as long as each
+ * row starts in pages that were already hinted, and starts over at one page when the scan jumps.
+ */
+static void scan_ahead (MDB *db, uint32_t page)
+{
+	uint32_t pages[MDB_BATCH_PAGES];
+	uint32_t count = 0;
+
+	if (!mdba_prefetch && db->batch_slots < 2)
+		return;
+
+	/* Rows tend to be alike, so the next headers are guessed from the size of the last row */
+	uint32_t stride = (page > db->scan_page) ? page - db->scan_page : 1;
+
+	if (page > db->scan_page && page <= db->scan_ahead)
+		db->scan_window = MIN (db->scan_window * 2, READ_AHEAD_PAGES);
+	else
+	{
+		db->scan_window = 1;
+		db->scan_ahead = page + 1;
+	}
+
+	db->scan_page = page;
+
+	uint32_t end = page + 1 + db->scan_window;
+
+	if (end < page)
+		return;
+
+	/* Don't hint past the terminator row, when it's known */
+	if (db->fsm_valid && page < db->fsm_end)
+		end = MIN (end, db->fsm_end + 1);
+
+	for (; db->scan_ahead < end; ++db->scan_ahead)
+		prefetch_page (db, db->scan_ahead);
+
+	/* The headers in the window are likely read next, so authenticate them together.  The pages
+	 * inside the rows are left out, since a scan of the headers never reads them. */
+	for (uint32_t header = page; header >= page && header < end && count < MDB_BATCH_PAGES; header += stride)
+		pages[count++] = header;
+
+	read_batch (db, pages, count);
+}
+
+
+/* Write the already encrypted and MAC'd page in `buf` to file position `pos`. */
+static int write_raw_page (MDB *db, uint8_t const *buf, uint64_t pos, bool sync)
+{
+	/* Padding, if necessary.
+ 	 * Re-use buf; blanking it would just cost extra cycles, and there is no risk. */
+	MDBA_IOVEC iov[2] = {
+		{ buf, db->real_page_size + 32 },
+		{ buf, db->page_size - db->real_page_size - 32 },
+	};
+
+	if (mdba_pwritev)
+	{
+		if (mdba_pwritev (db->fd, iov, (iov[1].len) ? 2 : 1, pos))
+			return MDBE_IO;
+	}
+	else
+	{
+		if (mdba_lseek (db->fd, pos, SEEK_SET))
+			return MDBE_IO;
+
+		for (int i = 0; i < 2; ++i)
+		{
+			if (mdba_write (db->fd, iov[i].base, iov[i].len))
+				return MDBE_IO;
+		}
+	}
+
+	if (!sync)
+	{
+		db->unsynced = true;
+		return 0;
+	}
+
+	if (mdba_fsync (db->fd))
+		return MDBE_IO;
+
+	return 0;
+}
+
+
+/* Make all page writes so far durable.  Only does work in MDB_SYNC_JOURNAL mode. */
+static int sync_pages (MDB *db)
+{
+	if (!db->unsynced)
+		return 0;
+
+	if (mdba_fsync (db->fd))
+		return MDBE_IO;
+
+	db->unsynced = false;
+
+	return 0;
+}
+
+
+/* Write db->tmp to the specified page.  If `sync` is false the write only becomes durable at
+ * the next sync_pages. */
+static int store_page (MDB *db, uint32_t page, bool sync)
+{
+	if (!db->fd)
+		return MDBE_NOT_OPEN;
+
+	int err;
+	uint64_t pos = page_pos (db, page);
+
+	db->tmp_page = 0;
+
+	/* Keep the cache coherent; the entry is dropped again if the write fails.  A copy in the batch
+	 * buffer is simply dropped. */
+	cache_store (db, page, db->tmp);
+	batch_invalidate (db, page);
+
+	/* Encrypt */
+	mdbc_encrypt (db->tmp, &db->cipher_keys, db->tmp, db->real_page_size, pos);
+	
+	/* MAC */
+	pack_uint64_little (db->tmp + db->real_page_size, pos);
+	mdbc_page_mac (db->tmp + db->real_page_size + 8, &db->cipher_keys, db->tmp, db->real_page_size + 8);
+	memmove (db->tmp + db->real_page_size, db->tmp + db->real_page_size + 8, 32);
+
+	/* Write */
+	if ((err = write_raw_page (db, db->tmp, pos, sync)))
+	{
+		cache_invalidate (db, page);
+		return err;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Write the first `count` pages of the batch buffer, which the caller filled with plaintext after
+ * emptying it, to the pages from `page_start` on.  Their MACs are computed together, and they are
+ * written last to first.
+ */
+static int store_batch (MDB *db, uint32_t page_start, uint32_t count, bool sync)
+{
+	int err;
+	void *macs[MDB_BATCH_PAGES];
+	void const *data[MDB_BATCH_PAGES];
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint8_t *buf = db->batch + i * MDB_PAGE_BUFFER_SIZE (db->page_size);
+		uint32_t page = page_start + i;
+
+		if (db->tmp_page == page)
+			db->tmp_page = 0;
+
+		cache_store (db, page, buf);
+
+		/* Encrypt */
+		mdbc_encrypt (buf, &db->cipher_keys, buf, db->real_page_size, page_pos (db, page));
+
+		pack_uint64_little (buf + db->real_page_size, page_pos (db, page));
+		macs[i] = buf + db->real_page_size + 8;
+		data[i] = buf;
+	}
+
+	/* MAC */
+	mdbc_page_mac_multi (macs, &db->cipher_keys, data, db->real_page_size + 8, count);
+
+	/* Write */
+	for (uint32_t i = count; i--; )
+	{
+		uint8_t *buf = db->batch + i * MDB_PAGE_BUFFER_SIZE (db->page_size);
+
+		memmove (buf + db->real_page_size, buf + db->real_page_size + 8, 32);
+
+		if ((err = write_raw_page (db, buf, page_pos (db, page_start + i), sync)))
+		{
+			for (uint32_t j = 0; j <= i; ++j)
+				cache_invalidate (db, page_start + j);
+
 			return err;
+		}
+	}
 
-		page_count = unpack_uint32_little (db->tmp);
-		row_id = unpack_uint32_little (db->tmp + 4);
+	return 0;
+}
 
-		/* Terminator Row?*/
-		if (page_count == 0)
+
+/* Write db->tmp to the specified page */
+static int write_page (MDB *db, uint32_t page)
+{
+	return store_page (db, page, db->sync_mode == MDB_SYNC_FULL);
+}
+
+
+/*
+ * Free Space Map
+ *
+ * Tracks the terminator row, and a bounded list of extents of empty rows.  The map only changes
+ * while a journal covers the affected pages, and journal recovery frees every span it nukes, so
+ * the saved map stays exact across crashes.  If there are more free extents than fit, the
+ * smallest ones are forgotten until the map is rebuilt.
+ */
+static void fsm_free (MDB *db, uint32_t page_start, uint32_t page_count)
+{
+	uint32_t start = page_start;
+	uint32_t end = page_start + page_count;
+	uint32_t i = 0, j;
+
+	if (!db->fsm_valid || page_count == 0)
+		return;
+
+	/* Freeing pages past the terminator means an append was rolled back; the terminator
+	 * written after those pages is the end now. */
+	db->fsm_end = MAX (db->fsm_end, end);
+
+	/* Merge with all overlapping and adjacent extents */
+	while (i < db->fsm_count && (db->fsm[i].start + db->fsm[i].count) < start)
+		++i;
+
+	for (j = i; j < db->fsm_count && db->fsm[j].start <= end; ++j)
+	{
+		start = MIN (start, db->fsm[j].start);
+		end = MAX (end, db->fsm[j].start + db->fsm[j].count);
+	}
+
+	if (j > i)
+	{
+		db->fsm[i].start = start;
+		db->fsm[i].count = end - start;
+		memmove (&db->fsm[i+1], &db->fsm[j], (db->fsm_count - j) * sizeof (MDB_EXTENT));
+		db->fsm_count -= j - i - 1;
+		return;
+	}
+
+	/* New extent.  When full, forget the smallest extent. */
+	if (db->fsm_count == MDB_FSM_EXTENTS)
+	{
+		uint32_t smallest = 0;
+
+		for (j = 1; j < db->fsm_count; ++j)
 		{
-			potential_start += potential_count;
-			break;
+			if (db->fsm[j].count < db->fsm[smallest].count)
+				smallest = j;
 		}
 
-		/* Occupied row? */
-		if (row_id != 0)
+		db->fsm_lossy = true;
+
+		if ((end - start) <= db->fsm[smallest].count)
+			return;
+
+		memmove (&db->fsm[smallest], &db->fsm[smallest+1], (db->fsm_count - smallest - 1) * sizeof (MDB_EXTENT));
+		db->fsm_count -= 1;
+
+		if (smallest < i)
+			i -= 1;
+	}
+
+	memmove (&db->fsm[i+1], &db->fsm[i], (db->fsm_count - i) * sizeof (MDB_EXTENT));
+	db->fsm[i].start = start;
+	db->fsm[i].count = end - start;
+	db->fsm_count += 1;
+}
+
+
+/* Pick where a row of page_count pages should go; possibly at, or running over, the terminator.
+ * Of the free extents it fits into, the one closest to the page `near` is used. */
+static uint32_t fsm_find (MDB const *db, uint32_t page_count, uint32_t near)
+{
+	uint32_t best = 0, best_distance = 0xffffffff;
+
+	/* Transactions only grow the database, so that they can be rolled back by truncating it */
+	if (db->txn_page)
+		return db->fsm_end;
+
+	for (uint32_t i = 0; i < db->fsm_count; ++i)
+	{
+		if (db->fsm[i].count < page_count)
+			continue;
+
+		uint32_t start = db->fsm[i].start;
+		uint32_t distance = (start >= near) ? start - near : near - start;
+
+		if (distance < best_distance)
 		{
-			potential_start += potential_count + page_count;
-			potential_count = 0;
+			best = start;
+			best_distance = distance;
+		}
+	}
+
+	if (best_distance != 0xffffffff)
+		return best;
+
+	/* Extend the last extent, if it ends at the terminator */
+	if (db->fsm_count > 0 && (db->fsm[db->fsm_count-1].start + db->fsm[db->fsm_count-1].count) == db->fsm_end)
+		return db->fsm[db->fsm_count-1].start;
+
+	return db->fsm_end;
+}
+
+
+/* Remove a span returned by fsm_find from the map. */
+static void fsm_take (MDB *db, uint32_t page_start, uint32_t page_count)
+{
+	uint32_t end = page_start + page_count;
+
+	for (uint32_t i = 0; i < db->fsm_count; ++i)
+	{
+		if (db->fsm[i].start != page_start)
 			continue;
+
+		if (db->fsm[i].count > page_count)
+		{
+			db->fsm[i].start = end;
+			db->fsm[i].count -= page_count;
+		}
+		else
+		{
+			memmove (&db->fsm[i], &db->fsm[i+1], (db->fsm_count - i - 1) * sizeof (MDB_EXTENT));
+			db->fsm_count -= 1;
 		}
 
-		if (page_count != 1)
-			return MDBE_CORRUPT;
+		break;
+	}
+
+	db->fsm_end = MAX (db->fsm_end, end);
+}
+
+
+/* Forget everything from `page` on; the database ends there now. */
+static void fsm_truncate (MDB *db, uint32_t page)
+{
+	if (!db->fsm_valid)
+		return;
+
+	while (db->fsm_count > 0 && db->fsm[db->fsm_count-1].start >= page)
+		db->fsm_count -= 1;
+
+	if (db->fsm_count > 0 && (db->fsm[db->fsm_count-1].start + db->fsm[db->fsm_count-1].count) > page)
+		db->fsm[db->fsm_count-1].count = page - db->fsm[db->fsm_count-1].start;
+
+	db->fsm_end = page;
+}
+
+
+/* Save the free space map (version 1.1 and later). */
+static int fsm_save (MDB *db)
+{
+	if (db->version == VERSION_1_0 || !db->fsm_valid)
+		return 0;
+
+	memset (db->tmp, 0, db->page_size);
+	pack_uint32_little (db->tmp, db->fsm_end);
+	pack_uint32_little (db->tmp + 4, db->fsm_lossy);
+	pack_uint32_little (db->tmp + 8, db->fsm_count);
+
+	for (uint32_t i = 0; i < db->fsm_count; ++i)
+	{
+		pack_uint32_little (db->tmp + 12 + i * 8, db->fsm[i].start);
+		pack_uint32_little (db->tmp + 16 + i * 8, db->fsm[i].count);
+	}
+
+	return write_page (db, FSM_PAGE);
+}
+
+
+/* Load the free space map.  Returns MDBE_CORRUPT if it is missing or damaged, and must be rebuilt. */
+static int fsm_load (MDB *db)
+{
+	int err;
+	uint32_t previous_end;
+
+	db->fsm_valid = false;
+
+	if (db->version == VERSION_1_0)
+		return MDBE_CORRUPT;
+
+	if ((err = read_page (db, FSM_PAGE)))
+		return err;
+
+	db->fsm_end = unpack_uint32_little (db->tmp);
+	db->fsm_lossy = unpack_uint32_little (db->tmp + 4) != 0;
+	db->fsm_count = unpack_uint32_little (db->tmp + 8);
+
+	if (db->fsm_count > MDB_FSM_EXTENTS || db->fsm_end < db->first_page)
+		return MDBE_CORRUPT;
+
+	previous_end = db->first_page;
+
+	for (uint32_t i = 0; i < db->fsm_count; ++i)
+	{
+		db->fsm[i].start = unpack_uint32_little (db->tmp + 12 + i * 8);
+		db->fsm[i].count = unpack_uint32_little (db->tmp + 16 + i * 8);
+
+		if (db->fsm[i].start < previous_end || db->fsm[i].count == 0 || db->fsm[i].count > (db->fsm_end - db->fsm[i].start))
+			return MDBE_CORRUPT;
+
+		previous_end = db->fsm[i].start + db->fsm[i].count;
+	}
+
+	db->fsm_valid = true;
+
+	return 0;
+}
+
+
+/* Rebuild the free space map by walking every row. */
+static int fsm_rebuild (MDB *db)
+{
+	int err;
+	uint32_t page = db->first_page;
+	uint32_t run_start = 0, run_count = 0;
+
+	db->fsm_valid = true;
+	db->fsm_lossy = false;
+	db->fsm_count = 0;
+	db->fsm_end = db->first_page;
+
+	while (1)
+	{
+		scan_ahead (db, page);
+
+		if ((err = read_page (db, page)))
+			break;
+
+		uint32_t page_count = unpack_uint32_little (db->tmp);
+		uint32_t row_id = unpack_uint32_little (db->tmp + 4);
+
+		/* Terminator or occupied row? */
+		if (page_count == 0 || row_id != 0)
+		{
+			fsm_free (db, run_start, run_count);
+			run_count = 0;
+		}
+
+		if (page_count == 0)
+		{
+			db->fsm_end = page;
+			return fsm_save (db);
+		}
+
+		if (row_id == 0)
+		{
+			if (page_count != 1)
+			{
+				err = MDBE_CORRUPT;
+				break;
+			}
+
+			if (run_count == 0)
+				run_start = page;
+
+			run_count += 1;
+		}
+
+		if ((page + page_count) < page)
+		{
+			err = MDBE_CORRUPT;
+			break;
+		}
+
+		page += page_count;
+	}
+
+	db->fsm_valid = false;
+
+	return err;
+}
+
+
+/* Rebuild the free space map if there is none (version 1.0, or a damaged map).  Returns
+ * MDBE_CORRUPT if the rows are too damaged to rebuild it from. */
+static int fsm_require (MDB *db)
+{
+	if (db->fsm_valid)
+		return 0;
+
+	return fsm_rebuild (db);
+}
+
+
+/* Replace a span of pages with empty rows, and record them in the free space map. */
+static int nuke_span (MDB *db, uint32_t page_start, uint32_t page_count)
+{
+	int err;
+
+	for (uint32_t count = page_count; count; )
+	{
+		/* Several at once, with a batch buffer */
+		if (db->batch_slots > 1 && count > 1)
+		{
+			uint32_t n = MIN (count, db->batch_slots);
+
+			db->batch_count = 0;
+
+			for (uint32_t i = 0; i < n; ++i)
+			{
+				uint8_t *buf = db->batch + i * MDB_PAGE_BUFFER_SIZE (db->page_size);
+
+				memset (buf, 0, db->page_size);
+				pack_uint32_little (buf, 1);
+			}
+
+			if ((err = store_batch (db, page_start + count - n, n, db->sync_mode == MDB_SYNC_FULL)))
+				return err;
+
+			count -= n;
+			continue;
+		}
+
+		/* Empty row */
+		memset (db->tmp, 0, db->page_size);
+		pack_uint32_little (db->tmp, 1);
+
+		if ((err = write_page (db, page_start + count - 1)))
+			return err;
+
+		count -= 1;
+	}
+
+	fsm_free (db, page_start, page_count);
+
+	return fsm_save (db);
+}
+
+
+/* Is the row at `page_start` still the commit row `page_count` pages long? */
+static int is_commit_row (MDB *db, uint32_t page_start, uint32_t page_count, bool *commit)
+{
+	int err;
+
+	if ((err = read_page (db, page_start)))
+		return err;
+
+	*commit = unpack_uint32_little (db->tmp) == page_count && unpack_uint32_little (db->tmp + 4) == SYSTEM_ROWID && db->tmp[8] == COMMIT_TABLE;
+
+	return 0;
+}
+
+
+/* Nuke every row listed in a commit row, then the commit row itself. */
+static int nuke_commit_row (MDB *db, uint32_t page_start, uint32_t page_count)
+{
+	int err;
+	uint8_t span[8];
+	bool commit;
+
+	if ((err = is_commit_row (db, page_start, page_count, &commit)))
+		return err;
+
+	/* If it isn't a commit row any more, it was nuked by an earlier, interrupted attempt */
+	if (commit)
+	{
+		uint32_t count = unpack_uint32_little (db->tmp + 9) / 8;
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			if ((err = read_value (db, page_start, page_count, span, i * 8, 8)))
+				return err;
+
+			/* Must point to a row */
+			if (unpack_uint32_little (span) < db->first_page)
+				return -1;
+
+			if ((err = nuke_span (db, unpack_uint32_little (span), unpack_uint32_little (span + 4))))
+				return err;
+		}
+
+		/* The commit row is nuked from its last page, so its header would outlive the spans it
+		 * lists; empty it first, so that an interrupted attempt doesn't read the nuked pages */
+		if (page_count > 1)
+		{
+			if ((err = read_page (db, page_start)))
+				return err;
+
+			pack_uint32_little (db->tmp + 9, 0);
+
+			if ((err = write_page (db, page_start)))
+				return err;
+		}
+	}
+
+	return nuke_span (db, page_start, page_count);
+}
+
+
+/*
+ * Nuke every row listed in a transaction's commit row, then the commit row itself.  A transaction
+ * that deleted many rows wrote some of them to earlier commit rows, each listed first by the next
+ * one.  The earliest of those still there is nuked first, so that an interrupted attempt can
+ * start over.
+ */
+static int nuke_commit (MDB *db, uint32_t page_start, uint32_t page_count)
+{
+	int err;
+	uint8_t span[8];
+	bool commit;
+	MDB_EXTENT row;
+
+	do
+	{
+		row.start = page_start;
+		row.count = page_count;
+
+		while (1)
+		{
+			if ((err = is_commit_row (db, row.start, row.count, &commit)))
+				return err;
+
+			if (!commit || unpack_uint32_little (db->tmp + 9) < 8)
+				break;
+
+			if ((err = read_value (db, row.start, row.count, span, 0, 8)))
+				return err;
+
+			if (unpack_uint32_little (span) < db->first_page)
+				return -1;
+
+			if ((err = is_commit_row (db, unpack_uint32_little (span), unpack_uint32_little (span + 4), &commit)))
+				return err;
+
+			if (!commit)
+				break;
+
+			row.start = unpack_uint32_little (span);
+			row.count = unpack_uint32_little (span + 4);
+		}
+
+		if ((err = nuke_commit_row (db, row.start, row.count)))
+			return err;
+	} while (row.start != page_start);
+
+	return 0;
+}
+
+
+/* Roll back a transaction.  Every row from `page` on was written by it, so the database simply
+ * ends there again. */
+static int truncate_rows (MDB *db, uint32_t page)
+{
+	int err;
+
+	/* Row terminator */
+	memset (db->tmp, 0, db->page_size);
+
+	if ((err = write_page (db, page)))
+		return err;
+
+	fsm_truncate (db, page);
+
+	return fsm_save (db);
+}
+
+
+static int cleanup_journal (MDB *db)
+{
+	int err;
+	uint32_t page_start, page_count, kind;
+
+	/* Check Journal 1 */
+	err = read_page (db, 1);
+	page_start = unpack_uint32_little (db->tmp);
+	page_count = unpack_uint32_little (db->tmp + 4);
+	kind = unpack_uint32_little (db->tmp + 8);
+
+	if (err == 0 && page_count != 0)
+	{
+		/* Must point to a row */
+		if (page_start < db->first_page)
+			return -1;
+
+		/* Journal 1 is valid, execute it */
+		/* Nuke Journal 0 (which also keeps everything a committing transaction wrote) */
+		if ((err = set_journal (db, JOURNAL0, 0, 0)))
+			return err;
+
+		/* Nuke target */
+		if (kind == JOURNAL_COMMIT)
+			err = nuke_commit (db, page_start, page_count);
+		else
+			err = nuke_span (db, page_start, page_count);
+
+		if (err)
+			return err;
+
+		/* Nuke Journal 1 */
+		if ((err = set_journal (db, JOURNAL1, 0, 0)))
+			return err;
+
+		return 0;
+	}
+	else if (err != 0 && err != MDBE_CORRUPT)
+		return err;
+
+	/* Check Journal 0 */
+	err = read_page (db, 0);
+	page_start = unpack_uint32_little (db->tmp);
+	page_count = unpack_uint32_little (db->tmp + 4);
+	kind = unpack_uint32_little (db->tmp + 8);
+
+	if (err == 0 && kind == JOURNAL_TRUNCATE)
+	{
+		/* Must point to a row */
+		if (page_start < db->first_page)
+			return -1;
+
+		/* Journal 0 is valid, roll back the transaction */
+		if ((err = truncate_rows (db, page_start)))
+			return err;
+
+		/* Nuke Journal 0 */
+		if ((err = set_journal (db, JOURNAL0, 0, 0)))
+			return err;
+
+		return 0;
+	}
+	else if (err == 0 && page_count != 0)
+	{
+		/* Must point to a row */
+		if (page_start < db->first_page)
+			return -1;
+
+		/* Journal 0 is valid, execute it */
+		/* Nuke target */
+		if ((err = nuke_span (db, page_start, page_count)))
+			return err;
+
+		/* Nuke Journal 0 */
+		if ((err = set_journal (db, JOURNAL0, 0, 0)))
+			return err;
+
+		return 0;
+	}
+	else if (err != 0 && err != MDBE_CORRUPT)
+		return err;
+
+	return 0;
+}
+
+
+void mdb_close (MDB *db)
+{
+	if (db->fd)
+	{
+		/* The index may be trusted again after everything it describes is durable.  An open
+		 * transaction is rolled back by the next open, so its changes to the index must not be. */
+		if (db->index_state == INDEX_DIRTY && !db->txn_page && sync_pages (db) == 0)
+			index_save (db, INDEX_CLEAN);
+
+		sync_pages (db);
+		mdba_close (db->fd);
+	}
+
+	/* The cache holds plaintext */
+	if (db->cache)
+		secure_memset (db->cache, 0, (size_t)(cache_bucket (db, db->cache_buckets) - db->cache));
+
+	/* So does the caller's page buffer, and the batch buffer */
+	if (db->tmp && db->tmp != db->tmp_buffer)
+		secure_memset (db->tmp, 0, db->tmp_size);
+
+	if (db->batch)
+		secure_memset (db->batch, 0, db->batch_slots * MDB_PAGE_BUFFER_SIZE (db->page_size));
+
+	/* Including the keys, raw and expanded */
+	secure_memset (db, 0, sizeof (MDB));
+}
+
+
+static int set_journal (MDB *db, int journal, uint32_t page_start, uint32_t page_count)
+{
+	return set_journal_ex (db, journal, JOURNAL_SPAN, page_start, page_count);
+}
+
+
+static int set_journal_ex (MDB *db, int journal, uint32_t kind, uint32_t page_start, uint32_t page_count)
+{
+	int err;
+
+	if (!db->fd)
+		return MDBE_NOT_OPEN;
+
+	if (journal != 0 && journal != 1)
+		return -1;
+
+	/* Journals order everything else; pages written before the journal changes must be durable
+	 * before it does, and the journal itself must be durable before anything that follows. */
+	if ((err = sync_pages (db)))
+		return err;
+
+	memset (db->tmp, 0, db->page_size);
+	pack_uint32_little (db->tmp, page_start);
+	pack_uint32_little (db->tmp + 4, page_count);
+	pack_uint32_little (db->tmp + 8, kind);
+
+	if ((err = write_page (db, journal)))
+		return err;
+
+	if ((err = sync_pages (db)))
+		return err;
+
+	return 0;
+}
+
+
+/* Check that the span picked by fsm_find really is empty rows, followed by the terminator if
+ * the span runs past it. */
+static int check_empty_span (MDB *db, uint32_t page_start, uint32_t page_count)
+{
+	int err;
+
+	if (page_start + page_count + 1 <= page_start)
+		return MDBE_FULL;
+
+	if (page_start < db->fsm_end)
+	{
+		if ((err = read_page (db, page_start)))
+			return err;
+
+		if (unpack_uint32_little (db->tmp) != 1 || unpack_uint32_little (db->tmp + 4) != 0)
+			return MDBE_CORRUPT;
+	}
+
+	if (page_start + page_count > db->fsm_end)
+	{
+		if ((err = read_page (db, db->fsm_end)))
+			return err;
+
+		if (unpack_uint32_little (db->tmp) != 0)
+			return MDBE_CORRUPT;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Find an empty row of the specified size by walking the rows from the start, for when there is no
+ * free space map.  Damaged rows before the space found still fail with MDBE_CORRUPT.  In a
+ * transaction, only the end of the database will do.
+ * Leaves journal0 open on the row, outside of a transaction.
+ */
+static int find_empty_row_scan (MDB *db, uint32_t *page_start, uint32_t requested_page_count)
+{
+	int err;
+	uint32_t potential_start = db->first_page;
+	uint32_t potential_count = 0;
+
+	while (1)
+	{
+		scan_ahead (db, potential_start + potential_count);
+
+		if ((err = read_page (db, potential_start + potential_count)))
+			return err;
+
+		uint32_t page_count = unpack_uint32_little (db->tmp);
+		uint32_t row_id = unpack_uint32_little (db->tmp + 4);
+
+		/* Terminator row? */
+		if (page_count == 0)
+		{
+			potential_start += potential_count;
+			break;
+		}
+
+		/* Occupied row? */
+		if (row_id != 0 || db->txn_page)
+		{
+			if (potential_start + potential_count + page_count < potential_start)
+				return MDBE_CORRUPT;
+
+			potential_start += potential_count + page_count;
+			potential_count = 0;
+			continue;
+		}
+
+		if (page_count != 1)
+			return MDBE_CORRUPT;
+
+		potential_count += 1;
+
+		if (potential_count == requested_page_count)
+			break;
+	}
+
+	if (potential_count != requested_page_count)
+	{
+		/* No empty rows big enough; create a new one at the end, after filling it with terminators */
+		if (potential_start + requested_page_count + 1 <= potential_start)
+			return MDBE_FULL;
+
+		for (uint32_t page = potential_start + 1; page <= potential_start + requested_page_count; ++page)
+		{
+			memset (db->tmp, 0, db->page_size);
+
+			if ((err = write_page (db, page)))
+				return err;
+		}
+	}
+
+	if (!db->txn_page && (err = set_journal (db, JOURNAL0, potential_start, requested_page_count)))
+		return err;
+
+	*page_start = potential_start;
+
+	return 0;
+}
+
+
+/* Find an empty row of the specified size, using the free space map, as close to the page `near`
+ * as possible.  Otherwise, creates a new empty row.
+ * Leaves journal0 open on the row.  In a transaction, rows are always created at the end of the
+ * database instead, where the transaction's journal0 already covers them.
+ */
+static int find_empty_row (MDB *db, uint32_t *page_start, uint32_t requested_page_count, uint32_t near)
+{
+	int err;
+	uint32_t potential_start;
+
+	if (!db->fd)
+		return MDBE_NOT_OPEN;
+
+	if (requested_page_count == 0 || requested_page_count == 0xffffffff)
+		return -1;
+
+	/* Without a map, walk the rows for space, like version 1.0 always did */
+	if ((err = fsm_require (db)))
+		return (err == MDBE_CORRUPT) ? find_empty_row_scan (db, page_start, requested_page_count) : err;
+
+	/* The map may have forgotten extents; look for them before growing the database. */
+	potential_start = fsm_find (db, requested_page_count, near);
+
+	if (db->fsm_lossy && !db->txn_page && potential_start + requested_page_count > db->fsm_end)
+	{
+		if ((err = fsm_rebuild (db)))
+			return (err == MDBE_CORRUPT) ? find_empty_row_scan (db, page_start, requested_page_count) : err;
+
+		potential_start = fsm_find (db, requested_page_count, near);
+	}
+
+	if ((err = check_empty_span (db, potential_start, requested_page_count)))
+	{
+		if (err != MDBE_CORRUPT)
+			return err;
+
+		/* The map disagrees with the rows; trust the rows */
+		if ((err = fsm_rebuild (db)))
+			return (err == MDBE_CORRUPT) ? find_empty_row_scan (db, page_start, requested_page_count) : err;
+
+		potential_start = fsm_find (db, requested_page_count, near);
+
+		if ((err = check_empty_span (db, potential_start, requested_page_count)))
+			return err;
+	}
+
+	/* If the row runs past the end of the database, fill the new space with terminator pages first */
+	if (potential_start + requested_page_count > db->fsm_end)
+	{
+		for (uint32_t page = db->fsm_end + 1; page <= potential_start + requested_page_count; ++page)
+		{
+			memset (db->tmp, 0, db->page_size);
+
+			if ((err = write_page (db, page)))
+				return err;
+		}
+	}
+
+	/* Open journal on new row */
+	if (!db->txn_page && (err = set_journal (db, JOURNAL0, potential_start, requested_page_count)))
+		return err;
+
+	/* Journal recovery frees the span again, should we crash before the row is finished */
+	fsm_take (db, potential_start, requested_page_count);
+
+	if ((err = fsm_save (db)))
+		return err;
+
+	*page_start = potential_start;
+
+	return 0;
+}
+
+
+/* Find the highest rowid of `count` tables, starting at `first_table`, by walking every row. */
+static int scan_max_rowids (MDB *db, uint32_t first_table, uint32_t count, uint32_t *maxima)
+{
+	int err;
+	uint32_t page_count;
+
+	memset (maxima, 0, count * sizeof (uint32_t));
+
+	for (uint32_t page = db->first_page; ; page += page_count)
+	{
+		scan_ahead (db, page);
+
+		if ((err = read_page (db, page)))
+			return err;
+
+		page_count = unpack_uint32_little (db->tmp);
+		uint32_t rowid = unpack_uint32_little (db->tmp + 4);
+		uint32_t table = db->tmp[8];
+
+		if (page_count == 0)
+			return 0;
+
+		if (rowid != 0 && rowid != SYSTEM_ROWID && table >= first_table && (table - first_table) < count)
+			maxima[table - first_table] = MAX (maxima[table - first_table], rowid);
+
+		if ((page + page_count) < page)
+			return MDBE_CORRUPT;
+	}
+}
+
+
+/* Read the highest rowid ever used in `table` (version 1.1 and later).  Rebuilds the metadata
+ * page from the rows if it is missing or damaged. */
+static int read_max_rowid (MDB *db, uint8_t table, uint32_t *rowid)
+{
+	int err;
+	uint32_t page = ROWID_PAGE + table / ROWID_PAGE_TABLES;
+	uint32_t maxima[ROWID_PAGE_TABLES];
+
+	if ((err = read_page (db, page)) == 0)
+	{
+		*rowid = unpack_uint32_little (db->tmp + (table % ROWID_PAGE_TABLES) * 4);
+		return 0;
+	}
+	else if (err != MDBE_CORRUPT)
+		return err;
+
+	if ((err = scan_max_rowids (db, table - table % ROWID_PAGE_TABLES, ROWID_PAGE_TABLES, maxima)))
+		return err;
+
+	memset (db->tmp, 0, db->page_size);
+
+	for (uint32_t i = 0; i < ROWID_PAGE_TABLES; ++i)
+		pack_uint32_little (db->tmp + i * 4, maxima[i]);
+
+	if ((err = write_page (db, page)))
+		return err;
+
+	*rowid = maxima[table % ROWID_PAGE_TABLES];
+
+	return 0;
+}
+
+
+/* Record `rowid` as the highest rowid used in `table` (version 1.1 and later). */
+static int write_max_rowid (MDB *db, uint8_t table, uint32_t rowid)
+{
+	int err;
+	uint32_t page = ROWID_PAGE + table / ROWID_PAGE_TABLES;
+
+	if (db->version == VERSION_1_0)
+		return 0;
+
+	if ((err = read_page (db, page)))
+		return err;
+
+	pack_uint32_little (db->tmp + (table % ROWID_PAGE_TABLES) * 4, rowid);
+
+	return write_page (db, page);
+}
+
+
+/*
+ * Primary Index
+ *
+ * A B+tree mapping (table, rowid) to the Page of the row.  Nodes are whole Pages inside index
+ * extents; rows with the rowid SYSTEM_ROWID and table INDEX_TABLE, whose Pages after the row header are handed out to
+ * nodes one at a time.  Node writes aren't journaled.  Instead the index is marked dirty on
+ * disk before the first change to the rows, and only marked clean again by mdb_close; a dirty
+ * index is rebuilt from the rows when the database is opened.  Empty leaves are never merged.
+ */
+static uint32_t node_capacity (MDB const *db)
+{
+	return (db->real_page_size - NODE_HEADER) / NODE_ENTRY;
+}
+
+
+static uint8_t *node_entry (uint8_t *node, uint32_t i)
+{
+	return node + NODE_HEADER + i * NODE_ENTRY;
+}
+
+
+static uint64_t node_key (uint8_t const *entry)
+{
+	return ((uint64_t)entry[0] << 32) | unpack_uint32_little (entry + 1);
+}
+
+
+/* Check that `node` is sane and at the expected level. */
+static int node_check (MDB const *db, uint8_t const *node, uint32_t level)
+{
+	if (unpack_uint32_little (node) != level || unpack_uint32_little (node + 4) > node_capacity (db))
+		return MDBE_CORRUPT;
+
+	if (level > 0 && unpack_uint32_little (node + 4) == 0)
+		return MDBE_CORRUPT;
+
+	return 0;
+}
+
+
+/* Read the node at `page` into db->tmp, checking that it is sane and at the expected level. */
+static int node_read (MDB *db, uint32_t page, uint32_t level)
+{
+	int err;
+
+	if ((err = read_page (db, page)))
+		return err;
+
+	return node_check (db, db->tmp, level);
+}
+
+
+/* Same as node_read, but into `buf` using load_page. */
+static int node_load (MDB const *db, uint32_t page, uint32_t level, uint8_t *buf)
+{
+	int err;
+
+	if ((err = load_page (db, page, buf)))
+		return err;
+
+	return node_check (db, buf, level);
+}
+
+
+/* Number of entries in `node` with a key less than or equal to `key`. */
+static uint32_t node_search (uint8_t *node, uint64_t key)
+{
+	uint32_t lo = 0, hi = unpack_uint32_little (node + 4);
+
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (node_key (node_entry (node, mid)) <= key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+/* Hand out a node Page from the current index extent.  index_prepare reserves enough of them. */
+static int index_alloc (MDB *db, uint32_t *page)
+{
+	if (db->index_next >= db->index_end)
+		return -1;
+
+	*page = db->index_next;
+	db->index_next += 1;
+
+	return 0;
+}
+
+
+/* Start a new index extent.  The rest of the current one, if any, is left unused. */
+static int index_grow (MDB *db)
+{
+	int err;
+	uint32_t page_start;
+
+	/* Find an empty row (leaves journal0 open on that row) */
+	if ((err = find_empty_row (db, &page_start, INDEX_EXTENT_PAGES, 0)))
+		return err;
+
+	memset (db->tmp, 0, db->page_size);
+	pack_uint32_little (db->tmp, INDEX_EXTENT_PAGES);
+	pack_uint32_little (db->tmp + 4, SYSTEM_ROWID);
+	db->tmp[8] = INDEX_TABLE;
+
+	if ((err = write_page (db, page_start)))
+		return err;
+
+	if (!db->txn_page && (err = set_journal (db, JOURNAL0, 0, 0)))
+		return err;
+
+	db->index_next = page_start + 1;
+	db->index_end = page_start + INDEX_EXTENT_PAGES;
+
+	return 0;
+}
+
+
+/* The index turned out to be damaged: fall back to scans, and mark it dirty on disk (unless
+ * index_prepare already did, or the database is read-only) so that the next open rebuilds it. */
+static int index_abandon (MDB *db)
+{
+	int err;
+
+	if (db->index_state == INDEX_CLEAN && !db->read_only)
+	{
+		db->index_state = INDEX_NONE;
+
+		if ((err = index_save (db, INDEX_DIRTY)))
+			return err;
+
+		return sync_pages (db);
+	}
+
+	db->index_state = INDEX_NONE;
+
+	return 0;
+}
+
+
+/* Must be called before every change to the rows.  The first change marks the index dirty on
+ * disk.  Also makes sure an insert can split every level of the tree without starting a new
+ * extent, since that can't be done while a row's journal is open. */
+static int index_prepare (MDB *db)
+{
+	int err;
+
+	if (db->index_state == INDEX_NONE)
+		return 0;
+
+	if (db->index_state == INDEX_CLEAN)
+	{
+		if ((err = index_save (db, INDEX_DIRTY)))
+			return err;
+
+		if ((err = sync_pages (db)))
+			return err;
+
+		db->index_state = INDEX_DIRTY;
+	}
+
+	if ((db->index_end - db->index_next) > db->index_height)
+		return 0;
+
+	return index_grow (db);
+}
+
+
+/* Look up the Page of a row. */
+static int index_get (MDB *db, uint8_t table, uint32_t rowid, uint32_t *page)
+{
+	int err;
+	uint64_t key = ((uint64_t)table << 32) | rowid;
+	uint32_t node = db->index_root;
+	uint32_t pos;
+
+	if (db->index_height == 0)
+		return MDBE_ROW_NOT_FOUND;
+
+	for (uint32_t level = db->index_height - 1; level > 0; --level)
+	{
+		if ((err = node_read (db, node, level)))
+			return err;
+
+		pos = node_search (db->tmp, key);
+		node = unpack_uint32_little (node_entry (db->tmp, pos ? pos - 1 : 0) + 5);
+	}
+
+	if ((err = node_read (db, node, 0)))
+		return err;
+
+	pos = node_search (db->tmp, key);
+
+	if (pos == 0 || node_key (node_entry (db->tmp, pos - 1)) != key)
+		return MDBE_ROW_NOT_FOUND;
+
+	*page = unpack_uint32_little (node_entry (db->tmp, pos - 1) + 5);
+
+	return 0;
+}
+
+
+/* Insert `entry` into the node at `page`.  If the node is full it is split, and `split` is set
+ * to the entry for the new right node, which belongs in the parent; otherwise split_page is 0. */
+static int node_insert (MDB *db, uint32_t page, uint32_t level, uint8_t const *entry, uint8_t *split, uint32_t *split_page)
+{
+	int err;
+	uint32_t capacity = node_capacity (db);
+	uint32_t half = (capacity + 1) / 2;
+	uint32_t right, next, pos;
+
+	*split_page = 0;
+
+	if ((err = node_read (db, page, level)))
+		return err;
+
+	pos = node_search (db->tmp, node_key (entry));
+
+	if (unpack_uint32_little (db->tmp + 4) < capacity)
+	{
+		uint32_t count = unpack_uint32_little (db->tmp + 4);
+
+		memmove (node_entry (db->tmp, pos + 1), node_entry (db->tmp, pos), (count - pos) * NODE_ENTRY);
+		memmove (node_entry (db->tmp, pos), entry, NODE_ENTRY);
+		pack_uint32_little (db->tmp + 4, count + 1);
+
+		return store_page (db, page, false);
+	}
+
+	/* Split.  The upper entries go to a new right node, written first, since there's only
+	 * the one buffer. */
+	if ((err = index_alloc (db, &right)))
+		return err;
+
+	next = unpack_uint32_little (db->tmp + 8);
+
+	if (pos >= half)
+	{
+		memmove (node_entry (db->tmp, 0), node_entry (db->tmp, half), (pos - half) * NODE_ENTRY);
+		memmove (node_entry (db->tmp, pos - half + 1), node_entry (db->tmp, pos), (capacity - pos) * NODE_ENTRY);
+		memmove (node_entry (db->tmp, pos - half), entry, NODE_ENTRY);
+	}
+	else
+		memmove (node_entry (db->tmp, 0), node_entry (db->tmp, half - 1), (capacity - half + 1) * NODE_ENTRY);
+
+	pack_uint32_little (db->tmp + 4, capacity + 1 - half);
+	pack_uint32_little (db->tmp + 8, next);
+	memmove (split, node_entry (db->tmp, 0), 5);
+	pack_uint32_little (split + 5, right);
+
+	if ((err = store_page (db, right, false)))
+		return err;
+
+	/* Truncate the left node, and link it to the right node */
+	if ((err = node_read (db, page, level)))
+		return err;
+
+	if (pos < half)
+	{
+		memmove (node_entry (db->tmp, pos + 1), node_entry (db->tmp, pos), (half - 1 - pos) * NODE_ENTRY);
+		memmove (node_entry (db->tmp, pos), entry, NODE_ENTRY);
+	}
+
+	pack_uint32_little (db->tmp + 4, half);
+	pack_uint32_little (db->tmp + 8, right);
+
+	if ((err = store_page (db, page, false)))
+		return err;
+
+	*split_page = right;
+
+	return 0;
+}
+
+
+/* Add a row to the index, or update its Page if it's already there. */
+static int index_put (MDB *db, uint8_t table, uint32_t rowid, uint32_t page)
+{
+	int err;
+	uint64_t key = ((uint64_t)table << 32) | rowid;
+	uint32_t path[INDEX_MAX_HEIGHT];
+	uint32_t node = db->index_root;
+	uint32_t pos, level, split_page;
+	uint8_t entry[NODE_ENTRY], split[NODE_ENTRY];
+
+	if (db->index_state == INDEX_NONE)
+		return 0;
+
+	entry[0] = table;
+	pack_uint32_little (entry + 1, rowid);
+	pack_uint32_little (entry + 5, page);
+
+	/* First leaf */
+	if (db->index_height == 0)
+	{
+		if ((err = index_alloc (db, &node)))
+			return err;
+
+		memset (db->tmp, 0, db->page_size);
+		pack_uint32_little (db->tmp + 4, 1);
+		memmove (node_entry (db->tmp, 0), entry, NODE_ENTRY);
+
+		if ((err = store_page (db, node, false)))
+			return err;
+
+		db->index_root = node;
+		db->index_height = 1;
+
+		return 0;
+	}
+
+	/* Find the leaf, remembering the way down */
+	for (level = db->index_height - 1; level > 0; --level)
+	{
+		path[level] = node;
+
+		if ((err = node_read (db, node, level)))
+			return err;
+
+		pos = node_search (db->tmp, key);
+		node = unpack_uint32_little (node_entry (db->tmp, pos ? pos - 1 : 0) + 5);
+	}
+
+	path[0] = node;
+
+	if ((err = node_read (db, node, 0)))
+		return err;
+
+	pos = node_search (db->tmp, key);
+
+	if (pos > 0 && node_key (node_entry (db->tmp, pos - 1)) == key)
+	{
+		pack_uint32_little (node_entry (db->tmp, pos - 1) + 5, page);
+		return store_page (db, node, false);
+	}
+
+	/* Insert, splitting nodes on the way up as needed */
+	for (level = 0; level < db->index_height; ++level)
+	{
+		if ((err = node_insert (db, path[level], level, entry, split, &split_page)))
+			return err;
+
+		if (split_page == 0)
+			return 0;
+
+		memmove (entry, split, NODE_ENTRY);
+	}
+
+	/* The root was split */
+	if (db->index_height == INDEX_MAX_HEIGHT)
+		return MDBE_FULL;
+
+	if ((err = index_alloc (db, &node)))
+		return err;
+
+	memset (db->tmp, 0, db->page_size);
+	pack_uint32_little (db->tmp, db->index_height);
+	pack_uint32_little (db->tmp + 4, 2);
+	pack_uint32_little (node_entry (db->tmp, 0) + 5, db->index_root);
+	memmove (node_entry (db->tmp, 1), entry, NODE_ENTRY);
+
+	if ((err = store_page (db, node, false)))
+		return err;
+
+	db->index_root = node;
+	db->index_height += 1;
+
+	return 0;
+}
+
+
+/* Remove a row from the index. */
+static int index_remove (MDB *db, uint8_t table, uint32_t rowid)
+{
+	int err;
+	uint64_t key = ((uint64_t)table << 32) | rowid;
+	uint32_t node = db->index_root;
+	uint32_t pos, count;
+
+	if (db->index_state == INDEX_NONE || db->index_height == 0)
+		return 0;
+
+	for (uint32_t level = db->index_height - 1; level > 0; --level)
+	{
+		if ((err = node_read (db, node, level)))
+			return err;
+
+		pos = node_search (db->tmp, key);
+		node = unpack_uint32_little (node_entry (db->tmp, pos ? pos - 1 : 0) + 5);
+	}
+
+	if ((err = node_read (db, node, 0)))
+		return err;
+
+	pos = node_search (db->tmp, key);
+	count = unpack_uint32_little (db->tmp + 4);
+
+	if (pos == 0 || node_key (node_entry (db->tmp, pos - 1)) != key)
+		return 0;
+
+	memmove (node_entry (db->tmp, pos - 1), node_entry (db->tmp, pos), (count - pos) * NODE_ENTRY);
+	pack_uint32_little (db->tmp + 4, count - 1);
+
+	return store_page (db, node, false);
+}
+
+
+/* Look up the Page of the row of `table` with the highest rowid.  Only the leaf where that row
+ * would be is searched, so rows in an earlier leaf aren't found if it's empty. */
+static int index_last (MDB *db, uint8_t table, uint32_t *page)
+{
+	int err;
+	uint64_t key = ((uint64_t)table << 32) | SYSTEM_ROWID;
+	uint32_t node = db->index_root;
+	uint32_t pos;
+
+	if (db->index_height == 0)
+		return MDBE_ROW_NOT_FOUND;
+
+	for (uint32_t level = db->index_height - 1; level > 0; --level)
+	{
+		if ((err = node_read (db, node, level)))
+			return err;
+
+		pos = node_search (db->tmp, key);
+		node = unpack_uint32_little (node_entry (db->tmp, pos ? pos - 1 : 0) + 5);
+	}
+
+	if ((err = node_read (db, node, 0)))
+		return err;
+
+	pos = node_search (db->tmp, key);
+
+	if (pos == 0 || node_entry (db->tmp, pos - 1)[0] != table)
+		return MDBE_ROW_NOT_FOUND;
+
+	*page = unpack_uint32_little (node_entry (db->tmp, pos - 1) + 5);
+
+	return 0;
+}
+
+
+/* Look up the first MDB_WALK_ROWS rows of `table` with a rowid above `rowid`, in rowid order,
+ * for mdb_walk.  Leaves are followed through their links to the next node on the same level. */
+static int index_walk (MDB *db, uint8_t table, uint32_t rowid)
+{
+	int err;
+	uint64_t key = ((uint64_t)table << 32) | rowid;
+	uint32_t node = db->index_root;
+	uint32_t pos;
+
+	db->walk_count = 0;
+	db->walk_next = 0;
+
+	if (db->index_height == 0)
+		return 0;
+
+	for (uint32_t level = db->index_height - 1; level > 0; --level)
+	{
+		if ((err = node_read (db, node, level)))
+			return err;
+
+		pos = node_search (db->tmp, key);
+		node = unpack_uint32_little (node_entry (db->tmp, pos ? pos - 1 : 0) + 5);
+	}
+
+	if ((err = node_read (db, node, 0)))
+		return err;
+
+	pos = node_search (db->tmp, key);
+
+	while (db->walk_count < MDB_WALK_ROWS)
+	{
+		if (pos == unpack_uint32_little (db->tmp + 4))
+		{
+			if ((node = unpack_uint32_little (db->tmp + 8)) == 0)
+				break;
+
+			if ((err = node_read (db, node, 0)))
+				return err;
+
+			pos = 0;
+			continue;
+		}
+
+		uint8_t const *entry = node_entry (db->tmp, pos);
+
+		if (entry[0] != table)
+			break;
+
+		db->walk_rowids[db->walk_count] = unpack_uint32_little (entry + 1);
+		db->walk_pages[db->walk_count] = unpack_uint32_little (entry + 5);
+		db->walk_count += 1;
+		pos += 1;
+	}
+
+	return 0;
+}
+
+
+/* Save the state of the index (version 1.1 and later). */
+static int index_save (MDB *db, uint8_t state)
+{
+	if (db->version == VERSION_1_0)
+		return 0;
+
+	memset (db->tmp, 0, db->page_size);
+	pack_uint32_little (db->tmp, state);
+	pack_uint32_little (db->tmp + 4, db->index_root);
+	pack_uint32_little (db->tmp + 8, db->index_height);
+	pack_uint32_little (db->tmp + 12, db->index_next);
+	pack_uint32_little (db->tmp + 16, db->index_end);
+
+	return write_page (db, INDEX_PAGE);
+}
+
+
+/* Load the state of the index.  Returns MDBE_CORRUPT if it wasn't closed cleanly, or is missing
+ * or damaged, and must be rebuilt. */
+static int index_load (MDB *db)
+{
+	int err;
+
+	db->index_state = INDEX_NONE;
+
+	if (db->version == VERSION_1_0)
+		return 0;
+
+	if ((err = read_page (db, INDEX_PAGE)))
+		return err;
+
+	if (unpack_uint32_little (db->tmp) != INDEX_CLEAN)
+		return MDBE_CORRUPT;
+
+	db->index_root = unpack_uint32_little (db->tmp + 4);
+	db->index_height = unpack_uint32_little (db->tmp + 8);
+	db->index_next = unpack_uint32_little (db->tmp + 12);
+	db->index_end = unpack_uint32_little (db->tmp + 16);
+
+	if (db->index_height > INDEX_MAX_HEIGHT || db->index_next > db->index_end)
+		return MDBE_CORRUPT;
+
+	db->index_state = INDEX_CLEAN;
+
+	return 0;
+}
+
+
+/* Drop the old index extents, and index every row. */
+static int index_build (MDB *db)
+{
+	int err;
+	uint32_t page_count;
+
+	/* Drop the old index extents */
+	for (uint32_t page = db->first_page; ; page += page_count)
+	{
+		scan_ahead (db, page);
+
+		if ((err = read_page (db, page)))
+			return err;
+
+		page_count = unpack_uint32_little (db->tmp);
+
+		if (page_count == 0)
+			break;
+
+		if (unpack_uint32_little (db->tmp + 4) == SYSTEM_ROWID && db->tmp[8] == INDEX_TABLE)
+		{
+			if ((err = set_journal (db, JOURNAL0, page, page_count)))
+				return err;
+
+			if ((err = cleanup_journal (db)))
+				return err;
+		}
+
+		if ((page + page_count) < page)
+			return MDBE_CORRUPT;
+	}
+
+	/* Index every row.  New index extents are skipped, like any other rows of another table. */
+	for (uint32_t page = db->first_page; ; page += page_count)
+	{
+		scan_ahead (db, page);
+
+		if ((err = read_page (db, page)))
+			return err;
+
+		page_count = unpack_uint32_little (db->tmp);
+		uint32_t rowid = unpack_uint32_little (db->tmp + 4);
+		uint8_t table = db->tmp[8];
+
+		if (page_count == 0)
+			return 0;
+
+		if (rowid != 0 && rowid != SYSTEM_ROWID)
+		{
+			if ((err = index_prepare (db)))
+				return err;
+
+			if ((err = index_put (db, table, rowid, page)))
+				return err;
+		}
+
+		if ((page + page_count) < page)
+			return MDBE_CORRUPT;
+	}
+}
+
+
+/* Rebuild the index by walking every row.  The state on disk is already not clean, so it
+ * stays that way until mdb_close. */
+static int index_rebuild (MDB *db)
+{
+	int err;
+
+	db->index_state = INDEX_DIRTY;
+	db->index_root = 0;
+	db->index_height = 0;
+	db->index_next = 0;
+	db->index_end = 0;
+
+	if ((err = index_build (db)))
+		db->index_state = INDEX_NONE;
+
+	return err;
+}
+
+
+/* Is `page` part of a row the open transaction deleted?  May use db->tmp. */
+static int txn_deleted (MDB *db, uint32_t page, bool *deleted)
+{
+	int err;
+	uint8_t span[8];
+	MDB_EXTENT row = db->txn_spilled;
+
+	*deleted = true;
+
+	for (uint32_t i = 0; i < db->txn_count; ++i)
+	{
+		if (page >= db->txn_deletes[i].start && (page - db->txn_deletes[i].start) < db->txn_deletes[i].count)
+			return 0;
+	}
+
+	/* Then the ones written to commit rows, from the last; all but the first list the one before */
+	for (uint32_t r = db->txn_spills; r > 0; --r)
+	{
+		MDB_EXTENT previous = { 0, 0 };
+
+		if ((err = read_page (db, row.start)))
+			return err;
+
+		uint32_t count = unpack_uint32_little (db->tmp + 9) / 8;
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			if ((err = read_value (db, row.start, row.count, span, i * 8, 8)))
+				return err;
+
+			uint32_t start = unpack_uint32_little (span);
+			uint32_t span_count = unpack_uint32_little (span + 4);
+
+			if (i == 0 && r > 1)
+			{
+				previous.start = start;
+				previous.count = span_count;
+			}
+			else if (page >= start && (page - start) < span_count)
+				return 0;
+		}
+
+		row = previous;
+	}
+
+	*deleted = false;
+
+	return 0;
+}
+
+
+/* Write the rows the open transaction deletes, and the commit row they were last written to (if
+ * any), to a new commit row.  The caller takes it over from db->insert_page. */
+static int txn_write_deletes (MDB *db)
+{
+	int err;
+	uint8_t spans[8 * 8];
+	uint32_t count = db->txn_count + (db->txn_spills ? 1 : 0);
+	uint32_t buffered = 0;
+
+	if ((err = insert_begin (db, COMMIT_TABLE, SYSTEM_ROWID, count * 8)))
+		return err;
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		MDB_EXTENT const *extent = db->txn_spills ? ((i == 0) ? &db->txn_spilled : &db->txn_deletes[i - 1]) : &db->txn_deletes[i];
+
+		pack_uint32_little (spans + buffered * 8, extent->start);
+		pack_uint32_little (spans + buffered * 8 + 4, extent->count);
+		buffered += 1;
+
+		if (buffered == sizeof (spans) / 8 || i + 1 == count)
+		{
+			if ((err = mdb_insert_continue (db, spans, buffered * 8)))
+				return err;
+
+			buffered = 0;
+		}
+	}
+
+	return 0;
+}
+
+
+/* Make room in txn_deletes, by writing them out to a commit row. */
+static int txn_spill (MDB *db)
+{
+	int err;
+
+	if ((err = txn_write_deletes (db)))
+		return err;
+
+	db->txn_spilled.start = db->insert_page;
+	db->txn_spilled.count = db->insert_page_count;
+	db->txn_spills += 1;
+	db->txn_count = 0;
+	db->insert_page = 0;
+	db->insert_page_count = 0;
+
+	return 0;
+}
+
+
+/* Record a row for the open transaction to delete when it commits. */
+static int txn_delete (MDB *db, uint32_t page_start, uint32_t page_count)
+{
+	int err;
+
+	/* Adjacent rows are nuked as one span */
+	for (uint32_t i = 0; i < db->txn_count; ++i)
+	{
+		if ((db->txn_deletes[i].start + db->txn_deletes[i].count) == page_start)
+		{
+			db->txn_deletes[i].count += page_count;
+			return 0;
+		}
+
+		if ((page_start + page_count) == db->txn_deletes[i].start)
+		{
+			db->txn_deletes[i].start = page_start;
+			db->txn_deletes[i].count += page_count;
+			return 0;
+		}
+	}
+
+	if (db->txn_count == MDB_TXN_DELETES && (err = txn_spill (db)))
+		return err;
+
+	db->txn_deletes[db->txn_count].start = page_start;
+	db->txn_deletes[db->txn_count].count = page_count;
+	db->txn_count += 1;
+
+	return 0;
+}
+
+
+/* Where a new row of `table` should go, to keep the table's rows together: where the row it
+ * replaces is, or else after the table's last row.  0 if there's nothing to go by. */
+static uint32_t row_near (MDB *db, uint8_t table)
+{
+	uint32_t page;
+
+	if (db->update_page)
+		return db->update_page;
+
+	if (db->txn_page || db->index_state == INDEX_NONE || index_last (db, table, &page))
+		return 0;
+
+	return page;
+}
+
+
+static int insert_begin (MDB *db, uint8_t table, uint32_t rowid, uint32_t valuelen)
+{
+	if (!db->fd)
+		return MDBE_NOT_OPEN;
+
+	if ((valuelen + 13) <= valuelen)
+		return MDBE_DATA_TOO_BIG;
+
+	if (db->insert_page)
+		return MDBE_BUSY;
+
+	int err;
+	uint32_t page_count = (valuelen + 13) / db->real_page_size;
+	uint32_t page_start;
+
+	if ((valuelen + 13) % db->real_page_size)
+		page_count += 1;
+
+	if ((err = index_prepare (db)))
+		return err;
+
+	/* Find an empty row (leaves journal0 open on that row) */
+	if ((err = find_empty_row (db, &page_start, page_count, row_near (db, table))))
+		return err;
+
+	/* Write row header */
+	memset (db->tmp, 0, db->page_size);
+	pack_uint32_little (db->tmp, page_count);
+	pack_uint32_little (db->tmp+4, rowid);
+	db->tmp[8] = table;
+	pack_uint32_little (db->tmp+9, valuelen);
+
+	if ((err = write_page (db, page_start)))
+		return err;
+
+	db->insert_page = page_start;
+	db->insert_page_count = page_count;
+	db->insert_offset = 13;
+
+	return 0;
+}
+
+
+int mdb_insert_begin (MDB *db, uint8_t table, uint32_t valuelen)
+{
+	int err;
+	uint32_t rowid;
+
+	if (!db->fd)
+		return MDBE_NOT_OPEN;
+
+	if (db->read_only)
+		return MDBE_READ_ONLY;
+
+	if (db->insert_page)
+		return MDBE_BUSY;
+
+	if ((err = mdb_get_next_rowid (db, table, &rowid)))
+		return err;
+
+	/* Reserve the rowid before the row can exist.  Should the insert not finish, the rowid is
+	 * simply never used. */
+	if ((err = write_max_rowid (db, table, rowid)))
+		return err;
+
+	return insert_begin (db, table, rowid, valuelen);
+}
+
+
+int mdb_insert_continue (MDB *db, void const *data, size_t len)
+{
+	int err;
+
+	if (!db->fd)
+		return MDBE_NOT_OPEN;
+
+	if (db->insert_page < db->first_page || db->insert_page_count == 0)
+		return MDBE_NO_ROW_SELECTED;
+
+	while (len)
+	{
+		uint32_t page = db->insert_offset / db->real_page_size;
+		uint32_t page_offset = db->insert_offset - page * db->real_page_size;
+		uint32_t available = db->real_page_size - page_offset;
+		uint32_t l = MIN (len, available);
+
+		if (page >= db->insert_page_count)
+			return -1;
+
+		if ((err = read_page (db, db->insert_page + page)))
+			return err;
+
+		memmove (db->tmp + page_offset, data, l);
+		data = (uint8_t const *)data + l;
+		len -= l;
+
+		if ((err = write_page (db, db->insert_page + page)))
+			return err;
+
+		db->insert_offset += l;
+	}
+
+	return 0;
+}
+
+
+int mdb_insert_finalize (MDB *db)
+{
+	int err;
+
+	if (!db->fd)
+		return MDBE_NOT_OPEN;
+
+	if (db->update_page)
+		return -1;
+
+	if (db->insert_page < db->first_page || db->insert_page_count == 0)
+		return -1;
+	
+	/* Close journal.  A transaction's journal stays open until it commits. */
+	if (!db->txn_page && (err = set_journal (db, JOURNAL0, 0, 0)))
+		return err;
+
+	db->selected_page = db->insert_page;
+	db->selected_page_count = db->insert_page_count;
+	db->insert_page = 0;
+	db->insert_page_count = 0;
+
+	/* The row is committed; if the index can't keep up, fall back to scans until it is rebuilt */
+	if (read_page (db, db->selected_page) || index_put (db, db->tmp[8], unpack_uint32_little (db->tmp + 4), db->selected_page))
+		db->index_state = INDEX_NONE;
+
+	return 0;
+}
+
+
+int mdb_insert (MDB *db, uint8_t table, void const *value, uint32_t valuelen)
+{
+	int err;
+
+	if ((err = mdb_insert_begin (db, table, valuelen)))
+		return err;
+
+	if ((err = mdb_insert_continue (db, value, valuelen)))
+		return err;
+
+	if ((err = mdb_insert_finalize (db)))
+		return err;
+
+	return 0;
+}
+
+
+int mdb_read_value (MDB *db, void *dst, uint32_t offset, size_t len)
+{
+	if (!db->fd)
+		return MDBE_NOT_OPEN;
+
+	if (db->selected_page < db->first_page || db->selected_page_count == 0)
+		return MDBE_NO_ROW_SELECTED;
+
+	return read_value (db, db->selected_page, db->selected_page_count, dst, offset, len);
+}
+
+
+/* Read (len) bytes at (offset) from the value of the row at `page_start`. */
+static int read_value (MDB *db, uint32_t page_start, uint32_t page_count, void *dst, uint32_t offset, size_t len)
+{
+	int err;
+	uint64_t datalen = (uint64_t)page_count * db->real_page_size;
+	uint32_t last_page, ahead;
+
+	if ((offset + 13) <= offset)
+		return -1;
+
+	/* Skip header */
+	offset += 13;
+
+	if (len == 0)
+		return 0;
+
+	last_page = (uint32_t)MIN ((offset + (uint64_t)len - 1) / db->real_page_size, page_count - 1);
+	ahead = offset / db->real_page_size;
+
+	while (len)
+	{
+		if (offset >= datalen)
+			return MDBE_NOT_ENOUGH_DATA;
+
+		uint32_t page = offset / db->real_page_size;
+		uint32_t page_offset = offset - (page * db->real_page_size);
+		uint32_t maxlen = db->real_page_size - page_offset;
+		uint32_t l = MIN (maxlen, len);
+
+		/* Keep the next pages of a long read in flight, and authenticate them together */
+		while (ahead < last_page && ahead < page + READ_AHEAD_PAGES)
+			prefetch_page (db, page_start + ++ahead);
+
+		read_batch_span (db, page_start + page, last_page - page + 1);
+
+		if ((err = read_page (db, page_start + page)))
+			return err;
+
+		memmove (dst, db->tmp + page_offset, l);
+		dst = (uint8_t *)dst + l;
+		offset += l;
+		len -= l;
+	}
+
+	return 0;
+}
+
+
+int64_t mdb_get_value (MDB *db, void *dst, size_t maxlen)
+{
+	int err;
+	uint32_t valuelen;
+
+	if (!db->fd)
+		return MDBE_NOT_OPEN;
+
+	if (db->selected_page < db->first_page || db->selected_page_count == 0)
+		return MDBE_NO_ROW_SELECTED;
+
+	if ((err = read_page (db, db->selected_page)))
+		return err;
+
+	valuelen = unpack_uint32_little (db->tmp + 9);
+
+	if (dst)
+	{
+		if (valuelen > maxlen)
+			return MDBE_DATA_TOO_BIG;
+
+		if ((err = mdb_read_value (db, dst, 0, valuelen)))
+			return err;
+	}
+
+	return (int64_t)valuelen;
+}
+
+
+int mdb_get_rowid (MDB *db, uint32_t *page, uint8_t *table, uint32_t *rowid)
+{
+	int err;
+
+	if (!db->fd)
+		return MDBE_NOT_OPEN;
+
+	if (db->selected_page < db->first_page || db->selected_page_count == 0)
+		return MDBE_NO_ROW_SELECTED;
+
+	if (page)
+		*page = db->selected_page;
+
+	if (!table && !rowid)
+		return 0;
+
+	if ((err = read_page (db, db->selected_page)))
+		return err;
+
+	if (table)
+		*table = db->tmp[8];
+
+	if (rowid)
+		*rowid = unpack_uint32_little (db->tmp+4);
+
+	return 0;
+}
+
+
+int mdb_select_by_rowid (MDB *db, uint8_t table, uint32_t rowid)
+{
+	int err;
+	uint8_t found_table;
+	uint32_t page, found_rowid;
+	uint32_t current_rowid = 0;
+
+	if (!db->fd)
+		return MDBE_NOT_OPEN;
+
+	if (db->index_state != INDEX_NONE)
+	{
+		err = index_get (db, table, rowid, &page);
 
-		potential_count += 1;
+		if (err == 0)
+			err = mdb_select_by_page (db, page);
 
-		if (potential_count == requested_page_count)
-		{
-			*page_start = potential_start;
-			return 0;
-		}
-	}
+		if (err == 0)
+			err = mdb_get_rowid (db, NULL, &found_table, &found_rowid);
 
-	/* No acceptable empty rows found, create a new one at the end */
-	if (potential_start + requested_page_count + 1 <= potential_start)
-		return MDBE_FULL;
+		if (err == 0 && (found_table != table || found_rowid != rowid))
+			err = MDBE_CORRUPT;
 
-	/* First, fill the space with terminator pages */
-	for (uint32_t count = 0; count <= requested_page_count; ++count)
-	{
-		memset (db->tmp, 0, db->page_size);
+		if (err == 0 || err == MDBE_ROW_NOT_FOUND || err == MDBE_IO)
+			return err;
 
-		if ((err = write_page (db, potential_start + count)))
+		/* The index is damaged; scan instead, and rebuild it at the next open */
+		if ((err = index_abandon (db)))
 			return err;
 	}
 
-	/* Open journal on new row */
-	if ((err = set_journal (db, JOURNAL0, potential_start, requested_page_count)))
-		return err;
+	while (1)
+	{
+		if ((err = mdb_walk (db, table, current_rowid == 0)) < 0)
+			return err;
 
-	*page_start = potential_start;
+		if (err == 1)
+			return MDBE_ROW_NOT_FOUND;
 
-	return 0;
+		if ((err = mdb_get_rowid (db, NULL, NULL, &current_rowid)))
+			return err;
+
+		if (current_rowid == 0)
+			return -1;
+
+		if (current_rowid == rowid)
+			return 0;
+	}
 }
 
 
-int mdb_insert_begin (MDB *db, uint8_t table, uint32_t valuelen)
+int mdb_select_by_page (MDB *db, uint32_t page)
 {
+	int err;
+	bool deleted = false;
+
 	if (!db->fd)
 		return MDBE_NOT_OPEN;
 
-	if ((valuelen + 13) <= valuelen)
-		return MDBE_DATA_TOO_BIG;
+	if (page < db->first_page)
+		return -1;
 
-	if (db->insert_page)
-		return MDBE_BUSY;
+	db->selected_page = page;
 
-	int err;
-	uint32_t page_count = MAX (1, (valuelen + 13) / db->page_size);
-	uint32_t page_start;
-	uint32_t rowid;
+	if ((err = read_page (db, db->selected_page)))
+	{
+		db->selected_page = 0;
+		db->selected_page_count = 0;
+		return err;
+	}
 
-	if ((err = mdb_get_next_rowid (db, table, &rowid)))
+	db->selected_page_count = unpack_uint32_little (db->tmp);
+
+	/* System rows, and rows an open transaction deleted, aren't rows the application can use */
+	if (db->selected_page_count != 0 && unpack_uint32_little (db->tmp + 4) != SYSTEM_ROWID && (err = txn_deleted (db, page, &deleted)))
+	{
+		db->selected_page = 0;
+		db->selected_page_count = 0;
 		return err;
+	}
 
-	/* Find an empty row (leaves journal0 open on that row) */
-	if ((err = find_empty_row (db, &page_start, page_count)))
+	if (db->selected_page_count == 0 || unpack_uint32_little (db->tmp + 4) == SYSTEM_ROWID || deleted)
+	{
+		db->selected_page = 0;
+		db->selected_page_count = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Select the row at `page`, if it is still the row `table`, `rowid`.  Returns 1 if it isn't. */
+static int walk_select (MDB *db, uint32_t page, uint8_t table, uint32_t rowid)
+{
+	int err;
+	bool deleted = false;
+
+	if (page < db->first_page)
+		return 1;
+
+	if ((err = read_page (db, page)))
 		return err;
 
-	/* Write row header */
-	memset (db->tmp, 0, db->page_size);
-	pack_uint32_little (db->tmp, page_count);
-	pack_uint32_little (db->tmp+4, rowid);
-	db->tmp[8] = table;
-	pack_uint32_little (db->tmp+9, valuelen);
+	uint32_t page_count = unpack_uint32_little (db->tmp);
 
-	if ((err = write_page (db, page_start)))
+	if (page_count == 0 || unpack_uint32_little (db->tmp + 4) != rowid || db->tmp[8] != table)
+		return 1;
+
+	if ((err = txn_deleted (db, page, &deleted)))
 		return err;
 
-	db->insert_page = page_start;
-	db->insert_page_count = page_count;
-	db->insert_offset = 13;
+	if (deleted)
+		return 1;
+
+	db->selected_page = page;
+	db->selected_page_count = page_count;
 
 	return 0;
 }
 
 
-int mdb_insert_continue (MDB *db, void const *data, size_t len)
+/*
+ * mdb_walk using the primary index.  The rows looked up in advance may have changed since:
+ * rows that were deleted are skipped, and rows that were updated are looked up again.  Rows
+ * inserted since have higher rowids, so they are found by a later look up.
+ */
+static int walk_index (MDB *db, uint8_t table, bool restart)
 {
 	int err;
 
-	if (!db->fd)
-		return MDBE_NOT_OPEN;
-
-	if (db->insert_page < FIRST_PAGE || db->insert_page_count == 0)
-		return MDBE_NO_ROW_SELECTED;
+	if (restart || table != db->walk_table)
+	{
+		db->walk_table = table;
+		db->walk_rowid = 0;
+		db->walk_count = 0;
+		db->walk_next = 0;
+	}
 
-	while (len)
+	while (1)
 	{
-		uint32_t page = db->insert_offset / db->real_page_size;
-		uint32_t page_offset = db->insert_offset - page * db->real_page_size;
-		uint32_t available = db->real_page_size - page_offset;
-		uint32_t l = MIN (len, available);
+		if (db->walk_next == db->walk_count)
+		{
+			if ((err = index_walk (db, table, db->walk_rowid)))
+				return err;
 
-		if (page >= db->insert_page_count)
-			return -1;
+			if (db->walk_count == 0)
+				return 1; /* End of table */
 
-		if ((err = read_page (db, db->insert_page + page)))
+			for (uint32_t i = 0; i < db->walk_count; ++i)
+				prefetch_page (db, db->walk_pages[i]);
+		}
+
+		uint32_t rowid = db->walk_rowids[db->walk_next];
+		uint32_t page = db->walk_pages[db->walk_next];
+
+		read_batch (db, db->walk_pages + db->walk_next, db->walk_count - db->walk_next);
+		db->walk_next += 1;
+		db->walk_rowid = rowid;
+
+		if ((err = walk_select (db, page, table, rowid)) <= 0)
 			return err;
 
-		memmove (db->tmp + page_offset, data, l);
-		data = (uint8_t const *)data + l;
-		len -= l;
+		err = index_get (db, table, rowid, &page);
 
-		if ((err = write_page (db, db->insert_page + page)))
+		if (err == MDBE_ROW_NOT_FOUND)
+			continue;
+
+		if (err)
 			return err;
 
-		db->insert_offset += l;
-	}
+		if ((err = walk_select (db, page, table, rowid)) <= 0)
+			return err;
 
-	return 0;
+		return MDBE_CORRUPT;
+	}
 }
 
 
-int mdb_insert_finalize (MDB *db)
+int mdb_walk (MDB *db, uint8_t table, bool restart)
 {
 	int err;
+	bool deleted = false;
 
 	if (!db->fd)
 		return MDBE_NOT_OPEN;
 
-	if (db->update_page)
-		return -1;
+	if (db->index_state != INDEX_NONE)
+	{
+		if ((err = walk_index (db, table, restart)) >= 0 || err == MDBE_IO)
+			return err;
 
-	if (db->insert_page < FIRST_PAGE || db->insert_page_count == 0)
-		return -1;
-	
-	/* Close journal */
-	if ((err = set_journal (db, JOURNAL0, 0, 0)))
-		return err;
+		/* The index is damaged; scan instead, and rebuild it at the next open.  A walk that is
+		 * under way can't be continued in page order, though. */
+		if (!restart)
+		{
+			index_abandon (db);
+			return err;
+		}
 
-	db->selected_page = db->insert_page;
-	db->selected_page_count = db->insert_page_count;
-	db->insert_page = 0;
-	db->insert_page_count = 0;
+		if ((err = index_abandon (db)))
+			return err;
+	}
 
-	return 0;
-}
+	if (restart)
+		db->selected_page = db->first_page;
+	else
+		db->selected_page += db->selected_page_count;
 
+	if (db->selected_page < db->first_page)
+		return -1;
 
-int mdb_insert (MDB *db, uint8_t table, void const *value, uint32_t valuelen)
-{
-	int err;
+	while (1)
+	{
+		scan_ahead (db, db->selected_page);
 
-	if ((err = mdb_insert_begin (db, table, valuelen)))
-		return err;
+		if ((err = read_page (db, db->selected_page)))
+			return err;
 
-	if ((err = mdb_insert_continue (db, value, valuelen)))
-		return err;
+		db->selected_page_count = unpack_uint32_little (db->tmp);
+		uint32_t rowid = unpack_uint32_little (db->tmp + 4);
+		uint32_t tableid = db->tmp[8];
 
-	if ((err = mdb_insert_finalize (db)))
-		return err;
+		if (db->selected_page_count == 0)
+			return 1; /* End of database */
 
-	return 0;
+		if (rowid > 0 && rowid != SYSTEM_ROWID && tableid == table)
+		{
+			if ((err = txn_deleted (db, db->selected_page, &deleted)))
+				return err;
+
+			if (!deleted)
+				return 0; /* Valid row found */
+		}
+
+		db->selected_page += db->selected_page_count;
+	}
 }
 
 
-int mdb_read_value (MDB *db, void *dst, uint32_t offset, size_t len)
+/* State of mdb_parallel_walk, shared by its threads */
+typedef struct
+{
+	MDB const *db;
+	uint8_t table;
+	MDB_WALK_CALLBACK callback;
+	void *ctx;
+	uint32_t threads;
+	uint8_t *buffers;
+	size_t buffer_size;
+	uint32_t max_rowid;
+	int stop;                             /* Set once a thread is done early, to stop the others */
+	int results[MDB_MAX_WALK_THREADS];
+} PARALLEL_WALK;
+
+
+/* Read the value of the row at `page`, whose first page is loaded into `header`, into `value`
+ * (using `buf` for the other pages), and hand it to the callback. */
+static int walk_deliver (PARALLEL_WALK *walk, uint32_t thread, uint32_t rowid, uint32_t page, uint8_t const *header, uint8_t *buf, uint8_t *value, size_t value_size)
 {
 	int err;
-	uint64_t datalen = db->selected_page_count * db->real_page_size;
+	MDB const *db = walk->db;
+	uint32_t page_count = unpack_uint32_little (header);
+	uint32_t len = unpack_uint32_little (header + 9);
 
-	if (!db->fd)
-		return MDBE_NOT_OPEN;
-
-	if (db->selected_page < FIRST_PAGE || db->selected_page_count == 0)
-		return MDBE_NO_ROW_SELECTED;
+	if (page_count == 0 || unpack_uint32_little (header + 4) != rowid || header[8] != walk->table)
+		return MDBE_CORRUPT;
 
-	if ((offset + 13) <= offset)
-		return -1;
+	if (len > value_size)
+		return MDBE_DATA_TOO_BIG;
 
-	/* Skip header */
-	offset += 13;
+	if ((uint64_t)len + 13 > (uint64_t)page_count * db->real_page_size)
+		return MDBE_CORRUPT;
 
-	while (len)
-	{
-		if (offset >= datalen)
-			return MDBE_NOT_ENOUGH_DATA;
+	uint32_t l = MIN (len, db->real_page_size - 13);
 
-		uint32_t page = offset / db->real_page_size;
-		uint32_t page_offset = offset - (page * db->real_page_size);
-		uint32_t maxlen = db->real_page_size - page_offset;
-		uint32_t l = MIN (maxlen, len);
+	memmove (value, header + 13, l);
 
-		if ((err = read_page (db, db->selected_page + page)))
+	for (uint32_t offset = l; offset < len; offset += l)
+	{
+		if ((err = load_page (db, ++page, buf)))
 			return err;
 
-		memmove (dst, db->tmp + page_offset, l);
-		dst = (uint8_t *)dst + l;
-		offset += l;
-		len -= l;
+		l = MIN (len - offset, db->real_page_size);
+		memmove (value + offset, buf, l);
 	}
 
-	return 0;
+	return walk->callback (walk->ctx, thread, rowid, value, len);
 }
 
 
-int64_t mdb_get_value (MDB *db, void *dst, size_t maxlen)
+/* Deliver the rows in the `thread`th share of the table's rowids, following the index leaves. */
+static int walk_share (PARALLEL_WALK *walk, uint32_t thread)
 {
 	int err;
-	uint32_t valuelen;
+	MDB const *db = walk->db;
+	uint8_t *leaf = walk->buffers + thread * walk->buffer_size;
+	uint8_t *row = leaf + MDB_PAGE_BUFFER_SIZE (db->page_size);
+	uint8_t *headers = row + MDB_PAGE_BUFFER_SIZE (db->page_size);
+	uint8_t *value = headers + MDB_BATCH_BUFFER_SIZE (db->page_size);
+	size_t value_size = walk->buffer_size - MDB_WALK_BUFFER_SIZE (db->page_size, 0);
+	uint32_t first = 1 + (uint32_t)((uint64_t)walk->max_rowid * thread / walk->threads);
+	uint32_t end = 1 + (uint32_t)((uint64_t)walk->max_rowid * (thread + 1) / walk->threads);
+	uint64_t key = ((uint64_t)walk->table << 32) | (first - 1);
+	uint32_t node = db->index_root;
+	uint32_t pos;
+
+	if (first == end || db->index_height == 0)
+		return 0;
 
-	if (!db->fd)
-		return MDBE_NOT_OPEN;
+	for (uint32_t level = db->index_height - 1; level > 0; --level)
+	{
+		if ((err = node_load (db, node, level, leaf)))
+			return err;
 
-	if (db->selected_page < FIRST_PAGE || db->selected_page_count == 0)
-		return MDBE_NO_ROW_SELECTED;
+		pos = node_search (leaf, key);
+		node = unpack_uint32_little (node_entry (leaf, pos ? pos - 1 : 0) + 5);
+	}
 
-	if ((err = read_page (db, db->selected_page)))
+	if ((err = node_load (db, node, 0, leaf)))
 		return err;
 
-	valuelen = unpack_uint32_little (db->tmp + 9);
+	pos = node_search (leaf, key);
 
-	if (dst)
+	while (!__atomic_load_n (&walk->stop, __ATOMIC_RELAXED))
 	{
-		if (valuelen > maxlen)
-			return MDBE_DATA_TOO_BIG;
+		if (pos == unpack_uint32_little (leaf + 4))
+		{
+			if ((node = unpack_uint32_little (leaf + 8)) == 0)
+				return 0;
 
-		if ((err = mdb_read_value (db, dst, 0, valuelen)))
+			if ((err = node_load (db, node, 0, leaf)))
+				return err;
+
+			pos = 0;
+			continue;
+		}
+
+		/* The first pages of the next rows on the leaf are loaded together */
+		uint32_t rowids[MDB_BATCH_PAGES], pages[MDB_BATCH_PAGES], count, loaded, corrupt;
+
+		for (count = 0; count < MDB_BATCH_PAGES && pos + count < unpack_uint32_little (leaf + 4); ++count)
+		{
+			uint8_t const *entry = node_entry (leaf, pos + count);
+
+			rowids[count] = unpack_uint32_little (entry + 1);
+			pages[count] = unpack_uint32_little (entry + 5);
+
+			if (entry[0] != walk->table || rowids[count] >= end)
+				break;
+		}
+
+		if (count == 0)
+			return 0;
+
+		if ((err = load_pages (db, pages, count, headers, &loaded, &corrupt)))
 			return err;
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			if (corrupt & (1u << i))
+				return MDBE_CORRUPT;
+
+			if ((err = walk_deliver (walk, thread, rowids[i], pages[i], headers + i * MDB_PAGE_BUFFER_SIZE (db->page_size), row, value, value_size)))
+				return err;
+		}
+
+		pos += count;
 	}
 
-	return (int64_t)valuelen;
+	return 0;
 }
 
 
-int mdb_get_rowid (MDB *db, uint32_t *page, uint8_t *table, uint32_t *rowid)
+static void walk_thread (void *arg, uint32_t thread)
+{
+	PARALLEL_WALK *walk = arg;
+
+	if ((walk->results[thread] = walk_share (walk, thread)))
+		__atomic_store_n (&walk->stop, 1, __ATOMIC_RELAXED);
+}
+
+
+int mdb_parallel_walk (MDB *db, uint8_t table, MDB_WALK_CALLBACK callback, void *ctx, uint32_t threads, void *buffers, size_t buffer_size)
 {
 	int err;
 
 	if (!db->fd)
 		return MDBE_NOT_OPEN;
 
-	if (db->selected_page < FIRST_PAGE || db->selected_page_count == 0)
-		return MDBE_NO_ROW_SELECTED;
+	if (!callback || !buffers || threads == 0 || threads > MDB_MAX_WALK_THREADS || buffer_size < MDB_WALK_BUFFER_SIZE (db->page_size, 0))
+		return MDBE_BAD_ARGUMENT;
 
-	if (page)
-		*page = db->selected_page;
+	/* Without the index, walk the rows on this thread */
+	if (db->index_state == INDEX_NONE)
+	{
+		uint8_t *value = (uint8_t *)buffers + MDB_WALK_BUFFER_SIZE (db->page_size, 0);
+		size_t value_size = buffer_size - MDB_WALK_BUFFER_SIZE (db->page_size, 0);
+
+		for (err = mdb_walk (db, table, true); err == 0; err = mdb_walk (db, table, false))
+		{
+			uint32_t rowid;
+			int64_t len;
+
+			if ((err = mdb_get_rowid (db, NULL, NULL, &rowid)))
+				return err;
+
+			if ((len = mdb_get_value (db, value, value_size)) < 0)
+				return (int)len;
+
+			if ((err = callback (ctx, 0, rowid, value, (uint32_t)len)))
+				return err;
+		}
 
-	if (!table && !rowid)
-		return 0;
+		return (err == 1) ? 0 : err;
+	}
 
-	if ((err = read_page (db, db->selected_page)))
+	PARALLEL_WALK walk = {
+		.db = db,
+		.table = table,
+		.callback = callback,
+		.ctx = ctx,
+		.threads = threads,
+		.buffers = buffers,
+		.buffer_size = buffer_size,
+	};
+
+	if ((err = read_max_rowid (db, table, &walk.max_rowid)))
 		return err;
 
-	if (table)
-		*table = db->tmp[8];
+	if (mdba_parallel && mdba_pread && threads > 1)
+		mdba_parallel (walk_thread, &walk, threads);
+	else
+	{
+		for (uint32_t i = 0; i < threads; ++i)
+			walk_thread (&walk, i);
+	}
 
-	if (rowid)
-		*rowid = unpack_uint32_little (db->tmp+4);
+	for (uint32_t i = 0; i < threads; ++i)
+	{
+		if (walk.results[i])
+			return walk.results[i];
+	}
 
 	return 0;
 }
 
 
-int mdb_select_by_rowid (MDB *db, uint8_t table, uint32_t rowid)
+/* State of mdb_verify, shared by its threads */
+typedef struct
 {
-	int err;
-	uint32_t current_rowid = 0;
-
-	if (!db->fd)
-		return MDBE_NOT_OPEN;
-
-	while (1)
+	MDB const *db;
+	MDB_VERIFY_CALLBACK callback;
+	void *ctx;
+	uint32_t threads;
+	uint8_t *buffers;
+	uint32_t end;                         /* Pages from first_page up to here are authenticated */
+	uint32_t problems[MDB_MAX_WALK_THREADS];
+	int results[MDB_MAX_WALK_THREADS];
+} PARALLEL_VERIFY;
+
+
+/* Authenticate the `thread`th share of the pages, reporting runs of corrupt pages. */
+static void verify_thread (void *arg, uint32_t thread)
+{
+	PARALLEL_VERIFY *verify = arg;
+	MDB const *db = verify->db;
+	uint8_t *buf = verify->buffers + thread * MDB_BATCH_BUFFER_SIZE (db->page_size);
+	uint32_t pages = verify->end - db->first_page;
+	uint32_t first = db->first_page + (uint32_t)((uint64_t)pages * thread / verify->threads);
+	uint32_t end = db->first_page + (uint32_t)((uint64_t)pages * (thread + 1) / verify->threads);
+	uint32_t run = 0;
+
+	for (uint32_t page = first; page < end; page += MDB_BATCH_PAGES)
 	{
-		if ((err = mdb_walk (db, table, current_rowid == 0)) < 0)
-			return err;
+		uint32_t batch[MDB_BATCH_PAGES], loaded, corrupt;
+		uint32_t count = MIN (end - page, MDB_BATCH_PAGES);
 
-		if (err == 1)
-			return MDBE_ROW_NOT_FOUND;
+		for (uint32_t i = 0; i < count; ++i)
+			batch[i] = page + i;
 
-		if ((err = mdb_get_rowid (db, NULL, NULL, &current_rowid)))
-			return err;
+		if ((verify->results[thread] = load_pages (db, batch, count, buf, &loaded, &corrupt)))
+			return;
 
-		if (current_rowid == 0)
-			return -1;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			if (corrupt & (1u << i))
+				run += 1;
+			else if (run)
+			{
+				verify->callback (verify->ctx, MDB_VERIFY_CORRUPT_PAGES, page + i - run, run);
+				verify->problems[thread] += 1;
+				run = 0;
+			}
+		}
+	}
 
-		if (current_rowid == rowid)
-			return 0;
+	if (run)
+	{
+		verify->callback (verify->ctx, MDB_VERIFY_CORRUPT_PAGES, end - run, run);
+		verify->problems[thread] += 1;
 	}
 }
 
 
-int mdb_select_by_page (MDB *db, uint32_t page)
+/* Compare a run of empty rows with the free space map; `*ext` is the next extent to look at. */
+static uint32_t verify_free_run (MDB *db, uint32_t start, uint32_t end, uint32_t *ext, MDB_VERIFY_CALLBACK callback, void *ctx)
 {
-	int err;
-
-	if (!db->fd)
-		return MDBE_NOT_OPEN;
-
-	if (page < FIRST_PAGE)
-		return -1;
-
-	db->selected_page = page;
+	uint32_t problems = 0;
+	bool known = false;
 
-	if ((err = read_page (db, db->selected_page)))
+	for (; *ext < db->fsm_count && db->fsm[*ext].start < end; *ext += 1)
 	{
-		db->selected_page = 0;
-		db->selected_page_count = 0;
-		return err;
-	}
+		uint32_t ext_start = db->fsm[*ext].start;
+		uint32_t ext_end = ext_start + db->fsm[*ext].count;
 
-	db->selected_page_count = unpack_uint32_little (db->tmp);
+		/* A lossy map may only know part of the run */
+		if (ext_start >= start && ext_end <= end && (db->fsm_lossy || (ext_start == start && ext_end == end)))
+			known = true;
+		else
+		{
+			callback (ctx, MDB_VERIFY_FREE_SPACE_MAP, ext_start, ext_end - ext_start);
+			problems += 1;
+		}
+	}
 
-	if (db->selected_page_count == 0)
+	if (start < end && !known && !db->fsm_lossy)
 	{
-		db->selected_page = 0;
-		db->selected_page_count = 0;
-		return -1;
+		callback (ctx, MDB_VERIFY_ORPHANED_SPAN, start, end - start);
+		problems += 1;
 	}
 
-	return 0;
+	return problems;
 }
 
 
-int mdb_walk (MDB *db, uint8_t table, bool restart)
+int mdb_verify (MDB *db, MDB_VERIFY_CALLBACK callback, void *ctx, uint32_t threads, void *buffers)
 {
 	int err;
+	int problems = 0;
+	uint32_t page, page_count = 0;
+	uint32_t run_start = 0, ext = 0;
+	bool check_fsm = db->fsm_valid;
+	bool terminated = false, deleted = false;
 
 	if (!db->fd)
 		return MDBE_NOT_OPEN;
 
-	if (restart)
-		db->selected_page = FIRST_PAGE;
-	else
-		db->selected_page += db->selected_page_count;
+	if (!callback || !buffers || threads == 0 || threads > MDB_MAX_WALK_THREADS)
+		return MDBE_BAD_ARGUMENT;
 
-	if (db->selected_page < FIRST_PAGE)
-		return -1;
+	/* Journals are only left open by a crash (recovered at open, unless read-only), or by a
+	 * transaction */
+	for (int journal = JOURNAL0; journal <= JOURNAL1; ++journal)
+	{
+		if ((err = read_page (db, journal)) == MDBE_IO)
+			return err;
 
-	while (1)
+		bool open = unpack_uint32_little (db->tmp + 4) != 0 || unpack_uint32_little (db->tmp + 8) == JOURNAL_TRUNCATE;
+
+		/* An unreadable journal is an empty one */
+		if (err == 0 && open && !(db->txn_page && journal == JOURNAL0))
+		{
+			callback (ctx, MDB_VERIFY_OPEN_JOURNAL, unpack_uint32_little (db->tmp), unpack_uint32_little (db->tmp + 4));
+			problems += 1;
+		}
+	}
+
+	/* Metadata pages in use */
+	for (page = FSM_PAGE; page <= INDEX_PAGE && page < db->first_page; ++page)
 	{
-		if ((err = read_page (db, db->selected_page)))
+		if ((err = read_page (db, page)) == MDBE_CORRUPT)
+		{
+			callback (ctx, MDB_VERIFY_CORRUPT_PAGES, page, 1);
+			problems += 1;
+		}
+		else if (err)
 			return err;
+	}
 
-		db->selected_page_count = unpack_uint32_little (db->tmp);
+	/* Follow the row headers, up to the terminator or the first one that can't be trusted */
+	for (page = db->first_page; ; page += page_count)
+	{
+		if ((err = read_page (db, page)) == MDBE_CORRUPT)
+			break;
+
+		if (err)
+			return err;
+
+		page_count = unpack_uint32_little (db->tmp);
 		uint32_t rowid = unpack_uint32_little (db->tmp + 4);
-		uint32_t tableid = db->tmp[8];
+		uint8_t table = db->tmp[8];
+		uint32_t len = unpack_uint32_little (db->tmp + 9);
 
-		if (db->selected_page_count == 0)
-			return 1; /* End of database */
+		if (rowid != 0 || page_count == 0)
+		{
+			if (check_fsm && run_start)
+				problems += verify_free_run (db, run_start, page, &ext, callback, ctx);
 
-		if (rowid > 0 && tableid == table)
-			return 0; /* Valid row found */
+			run_start = 0;
+		}
+		else if (run_start == 0)
+			run_start = page;
 
-		db->selected_page += db->selected_page_count;
-	}
-}
+		if (page_count == 0)
+		{
+			terminated = true;
+			break;
+		}
+
+		if (page + page_count < page || (rowid == 0 && page_count != 1))
+		{
+			callback (ctx, MDB_VERIFY_BAD_ROW, page, page_count);
+			problems += 1;
+			break;
+		}
 
+		if (rowid == SYSTEM_ROWID)
+		{
+			/* A commit row outlives its transaction only if cleaning up after it failed */
+			if (table == COMMIT_TABLE && !db->txn_page)
+			{
+				callback (ctx, MDB_VERIFY_ORPHANED_SPAN, page, page_count);
+				problems += 1;
+			}
+			else if (table != COMMIT_TABLE && table != INDEX_TABLE)
+			{
+				callback (ctx, MDB_VERIFY_BAD_ROW, page, page_count);
+				problems += 1;
+			}
+		}
+		else if (rowid != 0)
+		{
+			uint32_t indexed;
 
-int mdb_get_next_rowid (MDB *db, uint8_t table, uint32_t *rowid)
-{
-	int err;
-	uint32_t maxrowid = 0;
-	uint32_t selected_page = db->selected_page;
-	uint32_t selected_page_count = db->selected_page_count;
+			if ((uint64_t)len + 13 > (uint64_t)page_count * db->real_page_size)
+			{
+				callback (ctx, MDB_VERIFY_BAD_ROW, page, page_count);
+				problems += 1;
+			}
 
-	if (!db->fd)
-		return MDBE_NOT_OPEN;
+			if (db->index_state != INDEX_NONE && (err = txn_deleted (db, page, &deleted)))
+				return err;
 
-	while (1)
+			if (db->index_state != INDEX_NONE && !deleted)
+			{
+				if ((err = index_get (db, table, rowid, &indexed)) && err != MDBE_ROW_NOT_FOUND && err != MDBE_CORRUPT)
+					return err;
+
+				if (err || indexed != page)
+				{
+					callback (ctx, MDB_VERIFY_UNINDEXED_ROW, page, page_count);
+					problems += 1;
+				}
+			}
+		}
+	}
+
+	if (terminated)
 	{
-		uint32_t current_rowid;
+		/* The map must know where the terminator is, and no extents past the last run */
+		if (check_fsm && db->fsm_end != page)
+		{
+			callback (ctx, MDB_VERIFY_FREE_SPACE_MAP, db->fsm_end, 0);
+			problems += 1;
+		}
 
-		if ((err = mdb_walk (db, table, maxrowid == 0)) < 0)
-			return err;
+		for (; check_fsm && ext < db->fsm_count; ++ext)
+		{
+			callback (ctx, MDB_VERIFY_FREE_SPACE_MAP, db->fsm[ext].start, db->fsm[ext].count);
+			problems += 1;
+		}
 
-		if (err == 1)
-			break;
+		page += 1;
+	}
+	else
+	{
+		/* The rows can't be followed any further; at least authenticate what should be rows */
+		page = (db->fsm_valid && db->fsm_end > page) ? db->fsm_end + 1 : page + 1;
+	}
 
-		if ((err = mdb_get_rowid (db, NULL, NULL, &current_rowid)))
-			return err;
+	/* Authenticate every page of the rows, on as many threads as possible */
+	PARALLEL_VERIFY verify = {
+		.db = db,
+		.callback = callback,
+		.ctx = ctx,
+		.threads = threads,
+		.buffers = buffers,
+		.end = page,
+	};
+
+	if (mdba_parallel && mdba_pread && threads > 1)
+		mdba_parallel (verify_thread, &verify, threads);
+	else
+	{
+		for (uint32_t i = 0; i < threads; ++i)
+			verify_thread (&verify, i);
+	}
 
-		if (current_rowid == 0)
-			return -1;
+	for (uint32_t i = 0; i < threads; ++i)
+	{
+		if (verify.results[i])
+			return verify.results[i];
 
-		maxrowid = MAX (maxrowid, current_rowid);
+		problems += (int)verify.problems[i];
 	}
 
-	db->selected_page = selected_page;
-	db->selected_page_count = selected_page_count;
+	return problems;
+}
+
+
+int mdb_get_next_rowid (MDB *db, uint8_t table, uint32_t *rowid)
+{
+	int err;
+	uint32_t maxrowid;
+
+	if (!db->fd)
+		return MDBE_NOT_OPEN;
+
+	if (db->version == VERSION_1_0)
+		err = scan_max_rowids (db, table, 1, &maxrowid);
+	else
+		err = read_max_rowid (db, table, &maxrowid);
+
+	if (err)
+		return err;
 
-	if (maxrowid == 0xFFFFFFFF)
+	/* The highest rowid is reserved for system rows */
+	if (maxrowid >= SYSTEM_ROWID - 1)
 		return MDBE_FULL;
 
 	*rowid = maxrowid + 1;
@@ -873,25 +3771,23 @@ int mdb_update_begin (MDB *db, uint32_t valuelen)
 	if (!db->fd)
 		return MDBE_NOT_OPEN;
 
+	if (db->read_only)
+		return MDBE_READ_ONLY;
+
 	/* Also checks if a row is currently selected */
 	if ((err = mdb_get_rowid (db, NULL, &table, &rowid)))
 		return err;
 
+	/* In a transaction, the old row is deleted when it commits; make room to record that now,
+	 * since it can't be written out while the new row is */
+	if (db->txn_page && db->txn_count == MDB_TXN_DELETES && (err = txn_spill (db)))
+		return err;
+
 	db->update_page = db->selected_page;
 	db->update_page_count = db->selected_page_count;
 
 	/* Begin creating the replacement row */
-	if ((err = mdb_insert_begin (db, table, valuelen)))
-		return err;
-
-	/* Overwrite row header to set rowid */
-	memset (db->tmp, 0, db->page_size);
-	pack_uint32_little (db->tmp, db->insert_page_count);
-	pack_uint32_little (db->tmp+4, rowid);
-	db->tmp[8] = table;
-	pack_uint32_little (db->tmp+9, valuelen);
-
-	if ((err = write_page (db, db->insert_page)))
+	if ((err = insert_begin (db, table, rowid, valuelen)))
 		return err;
 
 	return 0;
@@ -911,18 +3807,29 @@ int mdb_update_finalize (MDB *db)
 	if (!db->fd)
 		return MDBE_NOT_OPEN;
 
-	if (db->update_page < FIRST_PAGE || db->update_page_count == 0)
+	if (db->update_page < db->first_page || db->update_page_count == 0)
 		return -1;
 
-	if (db->insert_page < FIRST_PAGE || db->insert_page_count == 0)
+	if (db->insert_page < db->first_page || db->insert_page_count == 0)
 		return -1;
 
-	/* Set journal to nuke old row */
-	if ((err = set_journal (db, JOURNAL1, db->update_page, db->update_page_count)))
-		return err;
+	if (db->txn_page)
+	{
+		if ((err = txn_delete (db, db->update_page, db->update_page_count)))
+			return err;
+	}
+	else
+	{
+		/* Set journal to nuke old row */
+		if ((err = set_journal (db, JOURNAL1, db->update_page, db->update_page_count)))
+			return err;
 
-	if ((err = cleanup_journal (db)))
-		return err;
+		if ((err = cleanup_journal (db)))
+			return err;
+	}
+
+	if (read_page (db, db->insert_page) || index_put (db, db->tmp[8], unpack_uint32_little (db->tmp + 4), db->insert_page))
+		db->index_state = INDEX_NONE;
 
 	/* Select the new row, if the old row was selected */
 	if (db->selected_page == db->update_page)
@@ -960,24 +3867,159 @@ int mdb_update (MDB *db, void const *value, uint32_t valuelen)
 int mdb_delete (MDB *db)
 {
 	int err;
+	uint8_t table;
+	uint32_t rowid;
 
 	if (!db->fd)
 		return MDBE_NOT_OPEN;
 
+	if (db->read_only)
+		return MDBE_READ_ONLY;
+
 	if (db->insert_page || db->update_page)
 		return MDBE_BUSY;
 
-	if (db->selected_page < FIRST_PAGE || db->selected_page_count == 0)
-		return MDBE_NO_ROW_SELECTED;
+	/* Also checks if a row is currently selected */
+	if ((err = mdb_get_rowid (db, NULL, &table, &rowid)))
+		return err;
 
-	if ((err = set_journal (db, JOURNAL0, db->selected_page, db->selected_page_count)))
+	if ((err = index_prepare (db)))
 		return err;
 
-	if ((err = cleanup_journal (db)))
+	if (db->txn_page)
+	{
+		if ((err = txn_delete (db, db->selected_page, db->selected_page_count)))
+			return err;
+	}
+	else
+	{
+		if ((err = set_journal (db, JOURNAL0, db->selected_page, db->selected_page_count)))
+			return err;
+
+		if ((err = cleanup_journal (db)))
+			return err;
+	}
+
+	if (index_remove (db, table, rowid))
+		db->index_state = INDEX_NONE;
+
+	db->selected_page = 0;
+	db->selected_page_count = 0;
+
+	return 0;
+}
+
+
+int mdb_txn_begin (MDB *db)
+{
+	int err;
+
+	if (!db->fd)
+		return MDBE_NOT_OPEN;
+
+	if (db->read_only)
+		return MDBE_READ_ONLY;
+
+	if (db->version == VERSION_1_0)
+		return MDBE_BAD_VERSION;
+
+	if (db->txn_page || db->insert_page || db->update_page)
+		return MDBE_BUSY;
+
+	/* The map knows where the database ends */
+	if ((err = fsm_require (db)))
+		return err;
+
+	/* Everything the transaction writes goes past the current end of the database */
+	if ((err = set_journal_ex (db, JOURNAL0, JOURNAL_TRUNCATE, db->fsm_end, 0)))
+		return err;
+
+	db->txn_page = db->fsm_end;
+	db->txn_count = 0;
+	db->txn_spills = 0;
+
+	return 0;
+}
+
+
+int mdb_txn_commit (MDB *db)
+{
+	int err;
+	uint32_t page_start, page_count;
+
+	if (!db->fd)
+		return MDBE_NOT_OPEN;
+
+	if (!db->txn_page)
+		return MDBE_NO_TRANSACTION;
+
+	if (db->insert_page || db->update_page)
+		return MDBE_BUSY;
+
+	/* Nothing to delete, so keeping what the transaction wrote is all that's left */
+	if (db->txn_count == 0 && db->txn_spills == 0)
+	{
+		if ((err = set_journal (db, JOURNAL0, 0, 0)))
+			return err;
+
+		db->txn_page = 0;
+
+		return 0;
+	}
+
+	/* Write the rows to delete into a commit row, at the end of the transaction's rows */
+	if ((err = txn_write_deletes (db)))
+		return err;
+
+	page_start = db->insert_page;
+	page_count = db->insert_page_count;
+	db->insert_page = 0;
+	db->insert_page_count = 0;
+
+	/* This is the commit point */
+	if ((err = set_journal_ex (db, JOURNAL1, JOURNAL_COMMIT, page_start, page_count)))
 		return err;
 
+	db->txn_page = 0;
+	db->txn_count = 0;
+	db->txn_spills = 0;
+
+	return cleanup_journal (db);
+}
+
+
+int mdb_txn_abort (MDB *db)
+{
+	int err;
+
+	if (!db->fd)
+		return MDBE_NOT_OPEN;
+
+	if (!db->txn_page)
+		return MDBE_NO_TRANSACTION;
+
+	/* An unfinished insert or update is rolled back with everything else */
+	db->insert_page = 0;
+	db->insert_page_count = 0;
+	db->update_page = 0;
+	db->update_page_count = 0;
 	db->selected_page = 0;
 	db->selected_page_count = 0;
 
+	/* Rows looked up by mdb_walk may be among the ones truncated, which are still readable */
+	db->walk_count = 0;
+	db->walk_next = 0;
+
+	if ((err = cleanup_journal (db)))
+		return err;
+
+	db->txn_page = 0;
+	db->txn_count = 0;
+	db->txn_spills = 0;
+
+	/* The index has the transaction's changes */
+	if (db->index_state == INDEX_DIRTY)
+		return index_rebuild (db);
+
 	return 0;
 }
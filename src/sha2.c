@@ -0,0 +1,475 @@
+/*
+ * SHA-256, using Intel's SHA extensions when the CPU has them, and HMAC-SHA-256 and PBKDF2 built
+ * on it.
+ */
+#include "sha2.h"
+#include <string.h>
+#include <meagerdb/app.h>
+#include "util.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	#define SHA2_X86 1
+	#include <immintrin.h>
+#else
+	#define SHA2_X86 0
+#endif
+
+
+static uint32_t const K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+
+static inline uint32_t unpack_uint32_big (uint8_t const src[static 4])
+{
+	return ((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) | ((uint32_t)src[2] << 8) | (uint32_t)src[3];
+}
+
+
+static inline void pack_uint32_big (uint8_t dst[static 4], uint32_t src)
+{
+	dst[0] = (uint8_t)(src >> 24);
+	dst[1] = (uint8_t)(src >> 16);
+	dst[2] = (uint8_t)(src >>  8);
+	dst[3] = (uint8_t)(src >>  0);
+}
+
+
+void mdbc_sha256_init (uint32_t state[static 8])
+{
+	state[0] = 0x6a09e667;
+	state[1] = 0xbb67ae85;
+	state[2] = 0x3c6ef372;
+	state[3] = 0xa54ff53a;
+	state[4] = 0x510e527f;
+	state[5] = 0x9b05688c;
+	state[6] = 0x1f83d9ab;
+	state[7] = 0x5be0cd19;
+}
+
+
+/* One round, with the roles of the working variables rotated instead of the variables */
+#define ROUND(a, b, c, d, e, f, g, h, i) do { \
+	uint32_t t1 = h + (ROTR32 (e, 6) ^ ROTR32 (e, 11) ^ ROTR32 (e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i]; \
+	uint32_t t2 = (ROTR32 (a, 2) ^ ROTR32 (a, 13) ^ ROTR32 (a, 22)) + ((a & b) ^ (a & c) ^ (b & c)); \
+	d += t1; \
+	h = t1 + t2; \
+} while (0)
+
+
+/* The 64 rounds, given the message schedule */
+static inline __attribute__((always_inline)) void rounds (uint32_t state[static 8], uint32_t const w[static 64])
+{
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+	for (unsigned int i = 0; i < 64; i += 8)
+	{
+		ROUND (a, b, c, d, e, f, g, h, i + 0);
+		ROUND (h, a, b, c, d, e, f, g, i + 1);
+		ROUND (g, h, a, b, c, d, e, f, i + 2);
+		ROUND (f, g, h, a, b, c, d, e, i + 3);
+		ROUND (e, f, g, h, a, b, c, d, i + 4);
+		ROUND (d, e, f, g, h, a, b, c, i + 5);
+		ROUND (c, d, e, f, g, h, a, b, i + 6);
+		ROUND (b, c, d, e, f, g, h, a, i + 7);
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+
+static void compress_c (uint32_t state[static 8], uint8_t const *blocks, size_t count)
+{
+	uint32_t w[64];
+
+	for (; count; --count, blocks += 64)
+	{
+		for (unsigned int i = 0; i < 16; ++i)
+			w[i] = unpack_uint32_big (blocks + 4 * i);
+
+		for (unsigned int i = 16; i < 64; ++i)
+		{
+			uint32_t s0 = ROTR32 (w[i-15], 7) ^ ROTR32 (w[i-15], 18) ^ (w[i-15] >> 3);
+			uint32_t s1 = ROTR32 (w[i-2], 17) ^ ROTR32 (w[i-2], 19) ^ (w[i-2] >> 10);
+
+			w[i] = w[i-16] + s0 + w[i-7] + s1;
+		}
+
+		rounds (state, w);
+	}
+
+	secure_memset (w, 0, sizeof (w));
+}
+
+
+#if SHA2_X86
+#define SHANI_TARGET __attribute__((target("sha,sse4.1")))
+
+/* Intel SHA extensions.  The state is kept as ABEF and CDGH, as the instructions want it. */
+static SHANI_TARGET void compress_shani (uint32_t state[static 8], uint8_t const *blocks, size_t count)
+{
+	__m128i const BSWAP = _mm_set_epi8 (12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m128i abef, cdgh, msg[4];
+	__m128i tmp = _mm_shuffle_epi32 (_mm_loadu_si128 ((__m128i const *)state), 0xB1);        /* CDAB */
+
+	cdgh = _mm_shuffle_epi32 (_mm_loadu_si128 ((__m128i const *)(state + 4)), 0x1B);          /* EFGH */
+	abef = _mm_alignr_epi8 (tmp, cdgh, 8);
+	cdgh = _mm_blend_epi16 (cdgh, tmp, 0xF0);
+
+	for (; count; --count, blocks += 64)
+	{
+		__m128i abef_save = abef, cdgh_save = cdgh;
+
+		for (unsigned int i = 0; i < 16; ++i)
+		{
+			__m128i *m = msg + (i & 3);
+
+			if (i < 4)
+				*m = _mm_shuffle_epi8 (_mm_loadu_si128 ((__m128i const *)(blocks + 16 * i)), BSWAP);
+			else
+			{
+				/* w[4i..4i+3] from the four groups before it */
+				*m = _mm_sha256msg1_epu32 (*m, msg[(i + 1) & 3]);
+				*m = _mm_add_epi32 (*m, _mm_alignr_epi8 (msg[(i + 3) & 3], msg[(i + 2) & 3], 4));
+				*m = _mm_sha256msg2_epu32 (*m, msg[(i + 3) & 3]);
+			}
+
+			tmp = _mm_add_epi32 (*m, _mm_loadu_si128 ((__m128i const *)(K + 4 * i)));
+			cdgh = _mm_sha256rnds2_epu32 (cdgh, abef, tmp);
+			abef = _mm_sha256rnds2_epu32 (abef, cdgh, _mm_shuffle_epi32 (tmp, 0x0E));
+		}
+
+		abef = _mm_add_epi32 (abef, abef_save);
+		cdgh = _mm_add_epi32 (cdgh, cdgh_save);
+	}
+
+	tmp = _mm_shuffle_epi32 (abef, 0x1B);                                                    /* FEBA */
+	cdgh = _mm_shuffle_epi32 (cdgh, 0xB1);                                                   /* DCHG */
+	_mm_storeu_si128 ((__m128i *)state, _mm_blend_epi16 (tmp, cdgh, 0xF0));                  /* DCBA */
+	_mm_storeu_si128 ((__m128i *)(state + 4), _mm_alignr_epi8 (cdgh, tmp, 8));               /* HGFE */
+
+	secure_memset (msg, 0, sizeof (msg));
+}
+
+#endif
+
+
+#if SHA2_X86
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+/* Load 32 bytes of each lane's block as eight vectors, each holding one big-endian word of every lane */
+static inline __attribute__((always_inline)) AVX2_TARGET void load_x8 (__m256i w[static 8], uint8_t const *const blocks[static 8], size_t offset)
+{
+	__m256i const BSWAP = _mm256_set_epi8 (12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+	                                       12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m256i r[8], t[8];
+
+	for (unsigned int lane = 0; lane < 8; ++lane)
+		r[lane] = _mm256_loadu_si256 ((__m256i const *)(blocks[lane] + offset));
+
+	for (unsigned int i = 0; i < 8; i += 2)
+	{
+		t[i] = _mm256_unpacklo_epi32 (r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32 (r[i], r[i + 1]);
+	}
+
+	for (unsigned int i = 0; i < 8; i += 4)
+	{
+		r[i] = _mm256_unpacklo_epi64 (t[i], t[i + 2]);
+		r[i + 1] = _mm256_unpackhi_epi64 (t[i], t[i + 2]);
+		r[i + 2] = _mm256_unpacklo_epi64 (t[i + 1], t[i + 3]);
+		r[i + 3] = _mm256_unpackhi_epi64 (t[i + 1], t[i + 3]);
+	}
+
+	for (unsigned int i = 0; i < 4; ++i)
+	{
+		w[i] = _mm256_shuffle_epi8 (_mm256_permute2x128_si256 (r[i], r[i + 4], 0x20), BSWAP);
+		w[i + 4] = _mm256_shuffle_epi8 (_mm256_permute2x128_si256 (r[i], r[i + 4], 0x31), BSWAP);
+	}
+}
+
+
+/* AVX2 */
+#define SHA_TARGET AVX2_TARGET
+#define SHA_COMPRESS compress_x8_avx2
+#define SHA_ROTR(x, n) _mm256_or_si256 (_mm256_srli_epi32 ((x), (n)), _mm256_slli_epi32 ((x), 32 - (n)))
+#define SHA_XOR3(x, y, z) _mm256_xor_si256 (_mm256_xor_si256 ((x), (y)), (z))
+#define SHA_CH(x, y, z) _mm256_xor_si256 (_mm256_and_si256 ((x), (y)), _mm256_andnot_si256 ((x), (z)))
+#define SHA_MAJ(x, y, z) _mm256_xor_si256 (_mm256_and_si256 ((x), (y)), _mm256_and_si256 ((z), _mm256_xor_si256 ((x), (y))))
+#include "sha2_kernel.h"
+
+
+/* AVX-512VL on the same 256-bit vectors, for its rotates and three-input logic */
+#define SHA_TARGET __attribute__((target("avx2,avx512f,avx512vl")))
+#define SHA_COMPRESS compress_x8_avx512
+#define SHA_ROTR(x, n) _mm256_ror_epi32 ((x), (n))
+#define SHA_XOR3(x, y, z) _mm256_ternarylogic_epi32 ((x), (y), (z), 0x96)
+#define SHA_CH(x, y, z) _mm256_ternarylogic_epi32 ((x), (y), (z), 0xCA)
+#define SHA_MAJ(x, y, z) _mm256_ternarylogic_epi32 ((x), (y), (z), 0xE8)
+#include "sha2_kernel.h"
+
+
+typedef void (*COMPRESS_X8) (uint32_t state[static 8][8], uint8_t const *const blocks[static 8], size_t count);
+
+
+/* mdbc_hmac_sha256 of up to eight messages of `len` bytes */
+static void hmac_x8 (COMPRESS_X8 compress_x8, void *const dst[], uint32_t const inner[static 8], uint32_t const outer[static 8], void const *const data[], size_t len, size_t count)
+{
+	uint32_t state[8][8];
+	uint8_t last[8][128];
+	uint8_t const *blocks[8];
+	size_t full = len & ~(size_t)63;
+	size_t remaining = len - full;
+	size_t last_len = (remaining < 56) ? 64 : 128;
+	uint64_t bits = (64 + len) * 8;
+
+	/* Unused lanes hash the first message again */
+	for (unsigned int lane = 0; lane < 8; ++lane)
+	{
+		for (unsigned int i = 0; i < 8; ++i)
+			state[i][lane] = inner[i];
+
+		blocks[lane] = data[(lane < count) ? lane : 0];
+	}
+
+	compress_x8 (state, blocks, full / 64);
+
+	/* Every message has the same length, so the padding is the same */
+	memset (last, 0, sizeof (last));
+
+	for (unsigned int lane = 0; lane < 8; ++lane)
+	{
+		memcpy (last[lane], blocks[lane] + full, remaining);
+		last[lane][remaining] = 0x80;
+		pack_uint32_big (last[lane] + last_len - 8, (uint32_t)(bits >> 32));
+		pack_uint32_big (last[lane] + last_len - 4, (uint32_t)bits);
+		blocks[lane] = last[lane];
+	}
+
+	compress_x8 (state, blocks, last_len / 64);
+
+	/* The outer hash is of the 32-byte inner hash, so one block */
+	memset (last, 0, sizeof (last));
+
+	for (unsigned int lane = 0; lane < 8; ++lane)
+	{
+		for (unsigned int i = 0; i < 8; ++i)
+		{
+			pack_uint32_big (last[lane] + 4 * i, state[i][lane]);
+			state[i][lane] = outer[i];
+		}
+
+		last[lane][32] = 0x80;
+		pack_uint32_big (last[lane] + 60, (64 + 32) * 8);
+	}
+
+	compress_x8 (state, blocks, 1);
+
+	for (unsigned int lane = 0; lane < count; ++lane)
+	{
+		for (unsigned int i = 0; i < 8; ++i)
+			pack_uint32_big ((uint8_t *)dst[lane] + 4 * i, state[i][lane]);
+	}
+
+	secure_memset (state, 0, sizeof (state));
+	secure_memset (last, 0, sizeof (last));
+}
+
+#endif
+
+
+void mdbc_sha256_compress (uint32_t state[static 8], uint8_t const *blocks, size_t count)
+{
+#if SHA2_X86
+	if (__builtin_cpu_supports ("sha"))
+		compress_shani (state, blocks, count);
+	else
+#endif
+		compress_c (state, blocks, count);
+}
+
+
+void mdbc_sha256_finish (uint8_t dst[static 32], uint32_t state[static 8], void const *data, size_t len, uint64_t prefix_len)
+{
+	uint8_t const *src = data;
+	uint8_t last[128] = {0};
+	size_t full = len & ~(size_t)63;
+	size_t remaining = len - full;
+	size_t last_len = (remaining < 56) ? 64 : 128;
+	uint64_t bits = (prefix_len + len) * 8;
+
+	mdbc_sha256_compress (state, src, full / 64);
+
+	/* Padding: 0x80, zeros, and the message length in bits */
+	memcpy (last, src + full, remaining);
+	last[remaining] = 0x80;
+	pack_uint32_big (last + last_len - 8, (uint32_t)(bits >> 32));
+	pack_uint32_big (last + last_len - 4, (uint32_t)bits);
+
+	mdbc_sha256_compress (state, last, last_len / 64);
+	secure_memset (last, 0, sizeof (last));
+
+	for (unsigned int i = 0; i < 8; ++i)
+		pack_uint32_big (dst + 4 * i, state[i]);
+}
+
+
+void mdbc_sha256 (uint8_t dst[static 32], void const *data, size_t len)
+{
+	uint32_t state[8];
+
+	mdbc_sha256_init (state);
+	mdbc_sha256_finish (dst, state, data, len, 0);
+}
+
+
+void mdbc_hmac_sha256_init (uint32_t inner[static 8], uint32_t outer[static 8], uint8_t const *key, size_t key_len)
+{
+	uint8_t pad[64] = {0};
+
+	/* Longer keys are hashed first */
+	if (key_len > sizeof (pad))
+		mdbc_sha256 (pad, key, key_len);
+	else
+		memcpy (pad, key, key_len);
+
+	for (unsigned int i = 0; i < sizeof (pad); ++i)
+		pad[i] ^= 0x36;
+
+	mdbc_sha256_init (inner);
+	mdbc_sha256_compress (inner, pad, 1);
+
+	for (unsigned int i = 0; i < sizeof (pad); ++i)
+		pad[i] ^= 0x36 ^ 0x5c;
+
+	mdbc_sha256_init (outer);
+	mdbc_sha256_compress (outer, pad, 1);
+
+	secure_memset (pad, 0, sizeof (pad));
+}
+
+
+void mdbc_hmac_sha256 (uint8_t dst[static 32], uint32_t const inner[static 8], uint32_t const outer[static 8], void const *data, size_t len)
+{
+	uint32_t state[8];
+	uint8_t inner_hash[32];
+
+	memcpy (state, inner, sizeof (state));
+	mdbc_sha256_finish (inner_hash, state, data, len, 64);
+
+	memcpy (state, outer, sizeof (state));
+	mdbc_sha256_finish (dst, state, inner_hash, sizeof (inner_hash), 64);
+
+	secure_memset (state, 0, sizeof (state));
+	secure_memset (inner_hash, 0, sizeof (inner_hash));
+}
+
+
+void mdbc_pbkdf2_hmac_sha256 (uint8_t *dst, uint8_t const *password, size_t password_len, uint8_t const *salt, size_t salt_len, uint32_t iterations, size_t dst_len)
+{
+	uint32_t inner[8], outer[8], state[8];
+	uint8_t tail[64 + 4], u[64] = {0}, t[32];
+	size_t salt_full = salt_len & ~(size_t)63;
+
+	mdbc_hmac_sha256_init (inner, outer, password, password_len);
+
+	/* Padding for the 32-byte messages of every iteration after the first, which then take one
+	 * compression each for the inner and outer hash */
+	u[32] = 0x80;
+	pack_uint32_big (u + 60, (64 + 32) * 8);
+
+	for (uint32_t block = 1; dst_len; ++block)
+	{
+		size_t n = (dst_len < 32) ? dst_len : 32;
+
+		/* U1 = HMAC (password, salt || block) */
+		memcpy (tail, salt + salt_full, salt_len - salt_full);
+		pack_uint32_big (tail + salt_len - salt_full, block);
+
+		memcpy (state, inner, sizeof (state));
+		mdbc_sha256_compress (state, salt, salt_full / 64);
+		mdbc_sha256_finish (u, state, tail, salt_len - salt_full + 4, 64 + salt_full);
+
+		memcpy (state, outer, sizeof (state));
+		mdbc_sha256_finish (u, state, u, 32, 64);
+
+		memcpy (t, u, sizeof (t));
+
+		/* U2 ... Uc */
+		for (uint32_t i = 1; i < iterations; ++i)
+		{
+			memcpy (state, inner, sizeof (state));
+			mdbc_sha256_compress (state, u, 1);
+
+			for (unsigned int j = 0; j < 8; ++j)
+				pack_uint32_big (u + 4 * j, state[j]);
+
+			memcpy (state, outer, sizeof (state));
+			mdbc_sha256_compress (state, u, 1);
+
+			for (unsigned int j = 0; j < 8; ++j)
+				pack_uint32_big (u + 4 * j, state[j]);
+
+			for (unsigned int j = 0; j < 32; ++j)
+				t[j] ^= u[j];
+		}
+
+		memcpy (dst, t, n);
+		dst += n;
+		dst_len -= n;
+	}
+
+	secure_memset (inner, 0, sizeof (inner));
+	secure_memset (outer, 0, sizeof (outer));
+	secure_memset (state, 0, sizeof (state));
+	secure_memset (tail, 0, sizeof (tail));
+	secure_memset (u, 0, sizeof (u));
+	secure_memset (t, 0, sizeof (t));
+}
+
+
+void mdbc_hmac_sha256_multi (void *const dst[], uint32_t const inner[static 8], uint32_t const outer[static 8], void const *const data[], size_t len, size_t count)
+{
+#if SHA2_X86
+	/* A single stream on the SHA extensions is about as fast per message as eight AVX2 lanes (and
+	 * faster for long messages), but eight AVX-512 lanes are faster still, once at least five of
+	 * them are in use */
+	COMPRESS_X8 compress_x8 = NULL;
+	size_t min_lanes = __builtin_cpu_supports ("sha") ? 5 : 2;
+
+	if (__builtin_cpu_supports ("avx512vl"))
+		compress_x8 = compress_x8_avx512;
+	else if (__builtin_cpu_supports ("avx2") && !__builtin_cpu_supports ("sha"))
+		compress_x8 = compress_x8_avx2;
+
+	while (compress_x8 && count >= min_lanes)
+	{
+		size_t n = MIN (count, 8);
+
+		hmac_x8 (compress_x8, dst, inner, outer, data, len, n);
+		dst += n;
+		data += n;
+		count -= n;
+	}
+#endif
+
+	for (size_t i = 0; i < count; ++i)
+		mdbc_hmac_sha256 (dst[i], inner, outer, data[i], len);
+}
@@ -0,0 +1,39 @@
+#ifndef __MEAGER_DB_SHA2_H__
+#define __MEAGER_DB_SHA2_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/* SHA-256, exposed at the level of the compression function so a prefix (e.g. an HMAC pad
+ * block) can be absorbed once and its state reused. */
+
+/* Set `state` to the SHA-256 initial hash value */
+void mdbc_sha256_init (uint32_t state[static 8]);
+
+/* Absorb `count` 64-byte blocks */
+void mdbc_sha256_compress (uint32_t state[static 8], uint8_t const *blocks, size_t count);
+
+/* Absorb the rest of a message, `prefix_len` bytes of which were already compressed into `state`,
+ * pad it, and write the hash to `dst`.  `state` is modified. */
+void mdbc_sha256_finish (uint8_t dst[static 32], uint32_t state[static 8], void const *data, size_t len, uint64_t prefix_len);
+
+
+/* SHA-256 of a whole message */
+void mdbc_sha256 (uint8_t dst[static 32], void const *data, size_t len);
+
+
+/* HMAC-SHA-256 with the pad blocks precomputed: `inner` and `outer` are the states after
+ * absorbing key^ipad and key^opad. */
+void mdbc_hmac_sha256_init (uint32_t inner[static 8], uint32_t outer[static 8], uint8_t const *key, size_t key_len);
+void mdbc_hmac_sha256 (uint8_t dst[static 32], uint32_t const inner[static 8], uint32_t const outer[static 8], void const *data, size_t len);
+
+/* mdbc_hmac_sha256 of `count` independent messages of `len` bytes each, into the 32 bytes at each
+ * dst[i].  Eight messages are hashed at once, in vector lanes, when that is faster on this CPU. */
+void mdbc_hmac_sha256_multi (void *const dst[], uint32_t const inner[static 8], uint32_t const outer[static 8], void const *const data[], size_t len, size_t count);
+
+
+/* PBKDF2 (RFC 8018) with HMAC-SHA-256 */
+void mdbc_pbkdf2_hmac_sha256 (uint8_t *dst, uint8_t const *password, size_t password_len, uint8_t const *salt, size_t salt_len, uint32_t iterations, size_t dst_len);
+
+#endif
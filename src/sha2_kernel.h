@@ -0,0 +1,103 @@
+/*
+ * Multi-buffer SHA-256: eight independent messages at once, one in each 32-bit lane of a __m256i.
+ * The state is kept transposed, as state[word][lane].  sha2.c includes this once per backend,
+ * after defining:
+ *
+ *   SHA_TARGET                    Function attributes the backend needs
+ *   SHA_COMPRESS                  Name of the function to define
+ *   SHA_ROTR(x, n)                Lane-wise rotation by a constant
+ *   SHA_XOR3(x, y, z)             x ^ y ^ z
+ *   SHA_CH(x, y, z)               (x & y) ^ (~x & z)
+ *   SHA_MAJ(x, y, z)              (x & y) ^ (x & z) ^ (y & z)
+ *
+ * All of them are undefined again at the end of this file.
+ */
+
+#define SHA_ADD(a, b) _mm256_add_epi32 ((a), (b))
+
+/* One round, with the roles of the working variables rotated instead of the variables */
+#define SHA_ROUND(a, b, c, d, e, f, g, h, i) do { \
+	__m256i t1 = SHA_ADD (SHA_ADD (h, SHA_XOR3 (SHA_ROTR (e, 6), SHA_ROTR (e, 11), SHA_ROTR (e, 25))), \
+		SHA_ADD (SHA_CH (e, f, g), SHA_ADD (_mm256_set1_epi32 ((int)K[i]), w[(i) & 15]))); \
+	__m256i t2 = SHA_ADD (SHA_XOR3 (SHA_ROTR (a, 2), SHA_ROTR (a, 13), SHA_ROTR (a, 22)), SHA_MAJ (a, b, c)); \
+	d = SHA_ADD (d, t1); \
+	h = SHA_ADD (t1, t2); \
+} while (0)
+
+/* w[i] from the 16 words before it, in place of w[i - 16] */
+#define SHA_SCHEDULE(i) do { \
+	__m256i x = w[((i) + 1) & 15], y = w[((i) + 14) & 15]; \
+	w[(i) & 15] = SHA_ADD (SHA_ADD (w[(i) & 15], w[((i) + 9) & 15]), \
+		SHA_ADD (SHA_XOR3 (SHA_ROTR (x, 7), SHA_ROTR (x, 18), _mm256_srli_epi32 (x, 3)), \
+			SHA_XOR3 (SHA_ROTR (y, 17), SHA_ROTR (y, 19), _mm256_srli_epi32 (y, 10)))); \
+} while (0)
+
+
+/* Absorb `count` 64-byte blocks from each of the eight lanes */
+static SHA_TARGET void SHA_COMPRESS (uint32_t state[static 8][8], uint8_t const *const blocks[static 8], size_t count)
+{
+	__m256i s[8], w[16];
+	uint8_t const *lanes[8];
+
+	for (unsigned int i = 0; i < 8; ++i)
+	{
+		s[i] = _mm256_loadu_si256 ((__m256i const *)state[i]);
+		lanes[i] = blocks[i];
+	}
+
+	for (; count; --count)
+	{
+		__m256i a = s[0], b = s[1], c = s[2], d = s[3];
+		__m256i e = s[4], f = s[5], g = s[6], h = s[7];
+
+		load_x8 (w, lanes, 0);
+		load_x8 (w + 8, lanes, 32);
+
+		for (unsigned int i = 0; i < 64; i += 8)
+		{
+			if (i >= 16)
+			{
+				for (unsigned int j = 0; j < 8; ++j)
+					SHA_SCHEDULE (i + j);
+			}
+
+			SHA_ROUND (a, b, c, d, e, f, g, h, i + 0);
+			SHA_ROUND (h, a, b, c, d, e, f, g, i + 1);
+			SHA_ROUND (g, h, a, b, c, d, e, f, i + 2);
+			SHA_ROUND (f, g, h, a, b, c, d, e, i + 3);
+			SHA_ROUND (e, f, g, h, a, b, c, d, i + 4);
+			SHA_ROUND (d, e, f, g, h, a, b, c, i + 5);
+			SHA_ROUND (c, d, e, f, g, h, a, b, i + 6);
+			SHA_ROUND (b, c, d, e, f, g, h, a, i + 7);
+		}
+
+		s[0] = SHA_ADD (s[0], a);
+		s[1] = SHA_ADD (s[1], b);
+		s[2] = SHA_ADD (s[2], c);
+		s[3] = SHA_ADD (s[3], d);
+		s[4] = SHA_ADD (s[4], e);
+		s[5] = SHA_ADD (s[5], f);
+		s[6] = SHA_ADD (s[6], g);
+		s[7] = SHA_ADD (s[7], h);
+
+		for (unsigned int i = 0; i < 8; ++i)
+			lanes[i] += 64;
+	}
+
+	for (unsigned int i = 0; i < 8; ++i)
+		_mm256_storeu_si256 ((__m256i *)state[i], s[i]);
+
+	secure_memset (w, 0, sizeof (w));
+}
+
+
+#undef SHA_ADD
+#undef SHA_ROUND
+#undef SHA_SCHEDULE
+
+#undef SHA_TARGET
+#undef SHA_COMPRESS
+#undef SHA_ROTR
+#undef SHA_XOR3
+#undef SHA_CH
+#undef SHA_MAJ
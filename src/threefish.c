@@ -0,0 +1,107 @@
+/*
+ * Threefish-512, several blocks at a time.  The rounds live in threefish_kernel.h, which is
+ * instantiated below for each backend; mdbc_threefish_* pick one at runtime.
+ */
+#include "threefish.h"
+#include <meagerdb/app.h>
+#include "basic_packing.h"
+#include "util.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	#define THREEFISH_X86 1
+	#include <immintrin.h>
+#else
+	#define THREEFISH_X86 0
+#endif
+
+
+void mdbc_threefish_expand_key (uint64_t k[static 9], uint8_t const key[static 64])
+{
+	k[8] = 0x1BD11BDAA9FC1A22ULL;
+
+	for (unsigned int i = 0; i < 8; ++i)
+	{
+		k[i] = unpack_uint64_little (key + 8 * i);
+		k[8] ^= k[i];
+	}
+}
+
+
+/* Transpose `lanes` blocks into words[word * stride + lane].  Unused lanes are zeroed. */
+static void gather_blocks (uint64_t *words, uint8_t const *src, uint32_t lanes, uint32_t stride)
+{
+	for (uint32_t lane = 0; lane < stride; ++lane)
+	{
+		for (unsigned int i = 0; i < 8; ++i)
+			words[i * stride + lane] = (lane < lanes) ? unpack_uint64_little (src + 64 * lane + 8 * i) : 0;
+	}
+}
+
+
+static void scatter_blocks (uint8_t *dst, uint64_t const *words, uint32_t lanes, uint32_t stride)
+{
+	for (uint32_t lane = 0; lane < lanes; ++lane)
+	{
+		for (unsigned int i = 0; i < 8; ++i)
+			pack_uint64_little (dst + 64 * lane + 8 * i, words[i * stride + lane]);
+	}
+}
+
+
+/* Plain C, one block at a time.  Also used on x86-64 without AVX2: two-lane SSE2 lacks a rotate
+ * instruction and is no faster than scalar code at our page sizes. */
+#define TF_V uint64_t
+#define TF_LANES 1
+#define TF_TARGET
+#define TF_ENCRYPT threefish_encrypt_c
+#define TF_DECRYPT threefish_decrypt_c
+#define TF_LOAD(p) (*(p))
+#define TF_STORE(p, v) (*(p) = (v))
+#define TF_SET1(x) ((uint64_t)(x))
+#define TF_ADD(a, b) ((a) + (b))
+#define TF_SUB(a, b) ((a) - (b))
+#define TF_XOR(a, b) ((a) ^ (b))
+#define TF_ROTL(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+#define TF_ROTR(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+#include "threefish_kernel.h"
+
+
+#if THREEFISH_X86
+/* AVX2, four blocks at a time */
+#define TF_V __m256i
+#define TF_LANES 4
+#define TF_TARGET __attribute__((target("avx2")))
+#define TF_ENCRYPT threefish_encrypt_avx2
+#define TF_DECRYPT threefish_decrypt_avx2
+#define TF_LOAD(p) _mm256_loadu_si256 ((__m256i const *)(p))
+#define TF_STORE(p, v) _mm256_storeu_si256 ((__m256i *)(p), (v))
+#define TF_SET1(x) _mm256_set1_epi64x ((long long)(x))
+#define TF_ADD(a, b) _mm256_add_epi64 ((a), (b))
+#define TF_SUB(a, b) _mm256_sub_epi64 ((a), (b))
+#define TF_XOR(a, b) _mm256_xor_si256 ((a), (b))
+#define TF_ROTL(x, n) _mm256_or_si256 (_mm256_slli_epi64 ((x), (n)), _mm256_srli_epi64 ((x), 64 - (n)))
+#define TF_ROTR(x, n) _mm256_or_si256 (_mm256_srli_epi64 ((x), (n)), _mm256_slli_epi64 ((x), 64 - (n)))
+#include "threefish_kernel.h"
+#endif
+
+
+void mdbc_threefish_encrypt (void *dst, uint64_t const k[static 9], void const *src, uint32_t blocks, uint64_t location)
+{
+#if THREEFISH_X86
+	if (__builtin_cpu_supports ("avx2"))
+		threefish_encrypt_avx2 (dst, k, src, blocks, location);
+	else
+#endif
+		threefish_encrypt_c (dst, k, src, blocks, location);
+}
+
+
+void mdbc_threefish_decrypt (void *dst, uint64_t const k[static 9], void const *src, uint32_t blocks, uint64_t location)
+{
+#if THREEFISH_X86
+	if (__builtin_cpu_supports ("avx2"))
+		threefish_decrypt_avx2 (dst, k, src, blocks, location);
+	else
+#endif
+		threefish_decrypt_c (dst, k, src, blocks, location);
+}
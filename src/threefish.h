@@ -0,0 +1,23 @@
+#ifndef __MEAGER_DB_THREEFISH_H__
+#define __MEAGER_DB_THREEFISH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/* Threefish-512 key schedule: the eight key words and their parity word */
+void mdbc_threefish_expand_key (uint64_t k[static 9], uint8_t const key[static 64]);
+
+
+/*
+ * Threefish-512 over `blocks` consecutive 64-byte blocks, where block i is processed with the
+ * tweak (location, i), as in mdbc_encrypt.  Same output as calling threefish512_*_block once per
+ * block, but several blocks are processed at once using the widest vector unit available at
+ * runtime (AVX2 on x86-64, plain C elsewhere).
+ * `k` is the key schedule from mdbc_threefish_expand_key.
+ * Must be able to *crypt in-place.
+ */
+void mdbc_threefish_encrypt (void *dst, uint64_t const k[static 9], void const *src, uint32_t blocks, uint64_t location);
+void mdbc_threefish_decrypt (void *dst, uint64_t const k[static 9], void const *src, uint32_t blocks, uint64_t location);
+
+#endif
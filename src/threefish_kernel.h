@@ -0,0 +1,156 @@
+/*
+ * Threefish-512 over a run of blocks, TF_LANES blocks at a time, with each word of the cipher
+ * state held in one TF_V (one lane per block).  threefish.c includes this once per backend, after
+ * defining:
+ *
+ *   TF_V, TF_LANES                Vector type, and the number of 64-bit lanes in it
+ *   TF_TARGET                     Function attributes the backend needs (may be empty)
+ *   TF_ENCRYPT, TF_DECRYPT        Names of the functions to define
+ *   TF_LOAD(p), TF_STORE(p, v)    Move TF_LANES words between memory and a vector
+ *   TF_SET1(x)                    Vector with x in every lane
+ *   TF_ADD, TF_SUB, TF_XOR        Lane-wise arithmetic
+ *   TF_ROTL(x, n), TF_ROTR(x, n)  Lane-wise rotation by a constant
+ *
+ * All of them are undefined again at the end of this file.
+ */
+
+#define TF_MIX(a, b, r)   do { a = TF_ADD (a, b); b = TF_XOR (TF_ROTL (b, r), a); } while (0)
+#define TF_UNMIX(a, b, r) do { b = TF_ROTR (TF_XOR (b, a), r); a = TF_SUB (a, b); } while (0)
+
+/* One round; the word permutation is folded into which words each round mixes */
+#define TF_ROUND(a, b, c, d, e, f, g, h, r0, r1, r2, r3) do { \
+	TF_MIX (x[a], x[b], r0); TF_MIX (x[c], x[d], r1); TF_MIX (x[e], x[f], r2); TF_MIX (x[g], x[h], r3); \
+} while (0)
+
+#define TF_UNROUND(a, b, c, d, e, f, g, h, r0, r1, r2, r3) do { \
+	TF_UNMIX (x[a], x[b], r0); TF_UNMIX (x[c], x[d], r1); TF_UNMIX (x[e], x[f], r2); TF_UNMIX (x[g], x[h], r3); \
+} while (0)
+
+/* Add (or subtract) subkey s.  t[1] holds each lane's block number, so the tweak differs per lane. */
+#define TF_SUBKEY(OP, s) do { \
+	x[0] = OP (x[0], TF_SET1 (k[((s) + 0) % 9])); \
+	x[1] = OP (x[1], TF_SET1 (k[((s) + 1) % 9])); \
+	x[2] = OP (x[2], TF_SET1 (k[((s) + 2) % 9])); \
+	x[3] = OP (x[3], TF_SET1 (k[((s) + 3) % 9])); \
+	x[4] = OP (x[4], TF_SET1 (k[((s) + 4) % 9])); \
+	x[5] = OP (x[5], TF_ADD (TF_SET1 (k[((s) + 5) % 9]), t[(s) % 3])); \
+	x[6] = OP (x[6], TF_ADD (TF_SET1 (k[((s) + 6) % 9]), t[((s) + 1) % 3])); \
+	x[7] = OP (x[7], TF_SET1 (k[((s) + 7) % 9] + (s))); \
+} while (0)
+
+
+static TF_TARGET void TF_ENCRYPT (uint8_t *dst, uint64_t const k[static 9], uint8_t const *src, uint32_t blocks, uint64_t location)
+{
+	uint64_t words[8 * TF_LANES], block_nums[TF_LANES];
+	TF_V x[8], t[3];
+
+	t[0] = TF_SET1 (location);
+
+	for (uint32_t block = 0; block < blocks; block += TF_LANES)
+	{
+		uint32_t lanes = MIN (blocks - block, TF_LANES);
+
+		for (uint32_t lane = 0; lane < TF_LANES; ++lane)
+			block_nums[lane] = block + lane;
+
+		t[1] = TF_LOAD (block_nums);
+		t[2] = TF_XOR (t[0], t[1]);
+
+		gather_blocks (words, src + 64 * (size_t)block, lanes, TF_LANES);
+
+		for (unsigned int i = 0; i < 8; ++i)
+			x[i] = TF_LOAD (words + i * TF_LANES);
+
+		for (unsigned int s = 0; s < 18; s += 2)
+		{
+			TF_SUBKEY (TF_ADD, s);
+			TF_ROUND (0, 1, 2, 3, 4, 5, 6, 7, 46, 36, 19, 37);
+			TF_ROUND (2, 1, 4, 7, 6, 5, 0, 3, 33, 27, 14, 42);
+			TF_ROUND (4, 1, 6, 3, 0, 5, 2, 7, 17, 49, 36, 39);
+			TF_ROUND (6, 1, 0, 7, 2, 5, 4, 3, 44,  9, 54, 56);
+			TF_SUBKEY (TF_ADD, s + 1);
+			TF_ROUND (0, 1, 2, 3, 4, 5, 6, 7, 39, 30, 34, 24);
+			TF_ROUND (2, 1, 4, 7, 6, 5, 0, 3, 13, 50, 10, 17);
+			TF_ROUND (4, 1, 6, 3, 0, 5, 2, 7, 25, 29, 39, 43);
+			TF_ROUND (6, 1, 0, 7, 2, 5, 4, 3,  8, 35, 56, 22);
+		}
+
+		TF_SUBKEY (TF_ADD, 18);
+
+		for (unsigned int i = 0; i < 8; ++i)
+			TF_STORE (words + i * TF_LANES, x[i]);
+
+		scatter_blocks (dst + 64 * (size_t)block, words, lanes, TF_LANES);
+	}
+
+	secure_memset (words, 0, sizeof (words));
+}
+
+
+static TF_TARGET void TF_DECRYPT (uint8_t *dst, uint64_t const k[static 9], uint8_t const *src, uint32_t blocks, uint64_t location)
+{
+	uint64_t words[8 * TF_LANES], block_nums[TF_LANES];
+	TF_V x[8], t[3];
+
+	t[0] = TF_SET1 (location);
+
+	for (uint32_t block = 0; block < blocks; block += TF_LANES)
+	{
+		uint32_t lanes = MIN (blocks - block, TF_LANES);
+
+		for (uint32_t lane = 0; lane < TF_LANES; ++lane)
+			block_nums[lane] = block + lane;
+
+		t[1] = TF_LOAD (block_nums);
+		t[2] = TF_XOR (t[0], t[1]);
+
+		gather_blocks (words, src + 64 * (size_t)block, lanes, TF_LANES);
+
+		for (unsigned int i = 0; i < 8; ++i)
+			x[i] = TF_LOAD (words + i * TF_LANES);
+
+		TF_SUBKEY (TF_SUB, 18);
+
+		for (unsigned int s = 18; s > 0; s -= 2)
+		{
+			TF_UNROUND (6, 1, 0, 7, 2, 5, 4, 3,  8, 35, 56, 22);
+			TF_UNROUND (4, 1, 6, 3, 0, 5, 2, 7, 25, 29, 39, 43);
+			TF_UNROUND (2, 1, 4, 7, 6, 5, 0, 3, 13, 50, 10, 17);
+			TF_UNROUND (0, 1, 2, 3, 4, 5, 6, 7, 39, 30, 34, 24);
+			TF_SUBKEY (TF_SUB, s - 1);
+			TF_UNROUND (6, 1, 0, 7, 2, 5, 4, 3, 44,  9, 54, 56);
+			TF_UNROUND (4, 1, 6, 3, 0, 5, 2, 7, 17, 49, 36, 39);
+			TF_UNROUND (2, 1, 4, 7, 6, 5, 0, 3, 33, 27, 14, 42);
+			TF_UNROUND (0, 1, 2, 3, 4, 5, 6, 7, 46, 36, 19, 37);
+			TF_SUBKEY (TF_SUB, s - 2);
+		}
+
+		for (unsigned int i = 0; i < 8; ++i)
+			TF_STORE (words + i * TF_LANES, x[i]);
+
+		scatter_blocks (dst + 64 * (size_t)block, words, lanes, TF_LANES);
+	}
+
+	secure_memset (words, 0, sizeof (words));
+}
+
+
+#undef TF_MIX
+#undef TF_UNMIX
+#undef TF_ROUND
+#undef TF_UNROUND
+#undef TF_SUBKEY
+
+#undef TF_V
+#undef TF_LANES
+#undef TF_TARGET
+#undef TF_ENCRYPT
+#undef TF_DECRYPT
+#undef TF_LOAD
+#undef TF_STORE
+#undef TF_SET1
+#undef TF_ADD
+#undef TF_SUB
+#undef TF_XOR
+#undef TF_ROTL
+#undef TF_ROTR
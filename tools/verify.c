@@ -0,0 +1,109 @@
+/*
+ * mdb-verify: check the integrity of a database with mdb_verify, on every core.
+ * Build it with `make verify APP=linux`.
+ *
+ * Usage: mdb-verify [-j threads] <database>
+ * The password is read from the first line of stdin.  The database is opened read-only
+ * (MDB_OPTIONS.read_only), so nothing is changed: an interrupted operation is reported as an open
+ * journal instead of being recovered, and an index that wasn't saved is not checked.
+ * Exits with 0 if no problems were found, 1 if some were, and 2 on errors.
+ */
+#define _GNU_SOURCE
+#include <meagerdb/meagerdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+static char const *problem_name (int problem)
+{
+	switch (problem)
+	{
+		case MDB_VERIFY_CORRUPT_PAGES: return "corrupt pages";
+		case MDB_VERIFY_BAD_ROW: return "bad row header";
+		case MDB_VERIFY_UNINDEXED_ROW: return "row missing from the index";
+		case MDB_VERIFY_ORPHANED_SPAN: return "orphaned span";
+		case MDB_VERIFY_FREE_SPACE_MAP: return "wrong free space map";
+		case MDB_VERIFY_OPEN_JOURNAL: return "open journal";
+		default: return "unknown problem";
+	}
+}
+
+
+static void report (void *ctx, int problem, uint32_t page, uint32_t page_count)
+{
+	(void)ctx;
+
+	/* One call to printf, since threads may report at the same time */
+	printf ("%s: pages %u to %u (%u)\n", problem_name (problem), page, page + page_count - (page_count ? 1 : 0), page_count);
+}
+
+
+int main (int argc, char **argv)
+{
+	static MDB db;
+	static uint8_t page_buffer[MDB_PAGE_BUFFER_SIZE (MDB_MAX_LARGE_PAGE_SIZE)];
+	MDB_OPTIONS options = { .page_buffer = page_buffer, .page_buffer_size = sizeof (page_buffer), .read_only = true };
+	long threads = sysconf (_SC_NPROCESSORS_ONLN);
+	char password[1024];
+	int opt, err;
+
+	while ((opt = getopt (argc, argv, "j:")) != -1)
+	{
+		if (opt != 'j' || (threads = strtol (optarg, NULL, 10)) <= 0)
+		{
+			fprintf (stderr, "Usage: %s [-j threads] <database>\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (optind != argc - 1)
+	{
+		fprintf (stderr, "Usage: %s [-j threads] <database>\n", argv[0]);
+		return 2;
+	}
+
+	if (threads < 1)
+		threads = 1;
+	else if (threads > MDB_MAX_WALK_THREADS)
+		threads = MDB_MAX_WALK_THREADS;
+
+	if (!fgets (password, sizeof (password), stdin))
+		password[0] = 0;
+
+	password[strcspn (password, "\r\n")] = 0;
+
+	err = mdb_open_ex (&db, argv[optind], (uint8_t const *)password, strlen (password), &options);
+	memset (password, 0, sizeof (password));
+
+	if (err)
+	{
+		fprintf (stderr, "%s: can't open %s (error %d)\n", argv[0], argv[optind], err);
+		return 2;
+	}
+
+	void *buffers = calloc ((size_t)threads, MDB_BATCH_BUFFER_SIZE (db.page_size));
+
+	if (!buffers)
+	{
+		mdb_close (&db);
+		fprintf (stderr, "%s: out of memory\n", argv[0]);
+		return 2;
+	}
+
+	int problems = mdb_verify (&db, report, NULL, (uint32_t)threads, buffers);
+
+	mdb_close (&db);
+	free (buffers);
+
+	if (problems < 0)
+	{
+		fprintf (stderr, "%s: verification failed (error %d)\n", argv[0], problems);
+		return 2;
+	}
+
+	printf ("%d problem%s found\n", problems, (problems == 1) ? "" : "s");
+
+	return (problems == 0) ? 0 : 1;
+}